@@ -0,0 +1,74 @@
+#ifndef _BIT_UTILS_H_
+#define _BIT_UTILS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// number of 64-bit words needed to hold n bits.
+#define NWORDS(N) (((N) + 63) / 64)
+
+// number of bits set in a 64-bit word.
+static inline unsigned int popcount64(uint64_t w)
+{
+#if defined(__GNUC__)
+	return (unsigned int) __builtin_popcountll(w);
+#else
+	unsigned int c;
+
+	for (c = 0; w != 0; c++)
+		w &= w - 1;
+	return c;
+#endif
+}
+
+// index of the lowest bit set in a non-zero 64-bit word.
+static inline unsigned int ctz64(uint64_t w)
+{
+#if defined(__GNUC__)
+	return (unsigned int) __builtin_ctzll(w);
+#else
+	unsigned int c = 0;
+
+	while ((w & 1) == 0)
+	{
+		w >>= 1;
+		c++;
+	}
+	return c;
+#endif
+}
+
+/* Writes u as a little-endian base-128 varint into buf, which must have
+ * room for ten bytes; returns the number of bytes written. */
+static inline size_t put_varint(unsigned char *buf, unsigned long u)
+{
+	size_t n = 0;
+
+	while (u >= 0x80)
+	{
+		buf[n++] = (unsigned char) (u | 0x80);
+		u >>= 7;
+	}
+	buf[n++] = (unsigned char) u;
+
+	return n;
+}
+
+/* Reads a varint from buf into *pu; returns the number of bytes read. */
+static inline size_t get_varint(const unsigned char *buf, unsigned long *pu)
+{
+	unsigned long u = 0;
+	size_t n = 0;
+	int shift = 0;
+
+	do
+	{
+		u |= (unsigned long) (buf[n] & 0x7f) << shift;
+		shift += 7;
+	} while (buf[n++] & 0x80);
+	*pu = u;
+
+	return n;
+}
+
+#endif
@@ -3,8 +3,13 @@
 
 /* If used as `EATLINE(X);', this macro reads every character until it finds a
  * newline, at which points it stops; since it does not make anything of such
- * characters, it effectively advances the buffer to the next line.
+ * characters, it effectively advances the buffer to the next line. It also
+ * stops at the end of the file, lest it loops forever on a truncated line.
  */
-#define EATLINE(X) while (fgetc(X) != '\n')
+#define EATLINE(X) do { \
+	int eatline_c_; \
+	while ((eatline_c_ = fgetc(X)) != '\n' && eatline_c_ != EOF) \
+		; \
+} while (0)
 
 #endif
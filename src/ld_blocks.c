@@ -0,0 +1,261 @@
+/* Interface implementation */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ld_blocks.h"
+
+#define DPRIME_STEPS 100 // D' likelihood is taken at 0, 0.01, ... 1
+#define DPRIME_TAIL 0.05 // on each side of the confidence interval
+#define MIN_FREQ 1e-10 // haplotype frequency floor for the likelihood
+
+static BLOCK_LOCUS *block_locus(LD_BLOCKS *pblocks, unsigned long seq);
+static void drop_block_loci(LD_BLOCKS *pblocks, unsigned long pos);
+static int write_block(LD_BLOCKS *pblocks);
+static void dprime_interval(const LD_PAIR *ppair, double *plow, double *phigh);
+
+
+// Open_blocks {{{
+void Open_blocks(LD_BLOCKS *pblocks, FILE *out, int winlen)
+{
+	memset(pblocks, 0, sizeof(LD_BLOCKS));
+	pblocks->out = out;
+	pblocks->winlen = winlen;
+	Open_ring(&pblocks->loci, sizeof(BLOCK_LOCUS));
+}
+// }}}
+
+// Block_sink {{{
+int Block_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+			   void *sink_data)
+{
+	LD_BLOCKS *pblocks = (LD_BLOCKS *) sink_data;
+	BLOCK_LOCUS *phead_locus, *plocus;
+	unsigned long col_strong = 0, col_recomb = 0, offset, s = 0;
+	bool found = false;
+	int status, c;
+
+	// The candidate can no longer grow once its end cannot pair with the head.
+	if (pblocks->open && phead->pos > pblocks->end.pos + pblocks->winlen)
+	{
+		if ((status = write_block(pblocks)) != VCF_OK)
+			return status;
+	}
+	drop_block_loci(pblocks, phead->pos);
+
+	if ((phead_locus = block_locus(pblocks, phead->seq)) == NULL)
+		return VCF_ENOMEM;
+	phead_locus->bound.seq = phead->seq;
+	phead_locus->bound.pos = phead->pos;
+	strcpy(phead_locus->bound.id, phead->id);
+
+	// Add the pairs ending at the head to the loci behind it, from the
+	// nearest, and take the earliest locus starting a block up to the head.
+	for (unsigned long seq = phead->seq; seq-- > pblocks->loci.first_seq; )
+	{
+		plocus = (BLOCK_LOCUS *) Ring_at(&pblocks->loci, seq);
+		offset = phead->seq - plocus->bound.seq - 1;
+		c = (offset < plocus->nclasses) ? plocus->classes[offset] : PAIR_UNINFORMATIVE;
+		col_strong += (c == PAIR_STRONG);
+		col_recomb += (c == PAIR_RECOMB);
+		plocus->nstrong += col_strong;
+		plocus->nrecomb += col_recomb;
+
+		if (plocus->bound.seq >= pblocks->floor_seq && c == PAIR_STRONG
+				&& plocus->nstrong >= BLOCK_MIN_STRONG * (plocus->nstrong + plocus->nrecomb))
+		{
+			s = seq;
+			found = true;
+		}
+	}
+
+	if (found)
+	{
+		plocus = (BLOCK_LOCUS *) Ring_at(&pblocks->loci, s);
+		if (pblocks->open && plocus->bound.seq > pblocks->end.seq)
+		{
+			if ((status = write_block(pblocks)) != VCF_OK)
+				return status;
+		}
+		// A block overlapping the candidate replaces it if longer.
+		if (!pblocks->open || plocus->bound.seq <= pblocks->start.seq
+				|| phead->pos - plocus->bound.pos > pblocks->end.pos - pblocks->start.pos)
+		{
+			pblocks->start = plocus->bound;
+			pblocks->end = phead_locus->bound;
+			pblocks->open = true;
+		}
+	}
+
+	// Keep the classes of the pairs of the head for the loci to come.
+	phead_locus->nclasses = 0;
+	for (size_t k = 0; k < npairs; k++)
+	{
+		if (pairs[k].alnum1 != (int) Nalleles_in_locus(phead) - 1
+				|| pairs[k].alnum2 != (int) Nalleles_in_locus(pairs[k].plocus2) - 1)
+			continue;
+		offset = pairs[k].plocus2->seq - phead->seq - 1;
+		if (offset >= phead_locus->maxclasses)
+		{
+			size_t maxclasses = (phead_locus->maxclasses == 0) ? 64 : phead_locus->maxclasses;
+			unsigned char *tmp;
+
+			while (maxclasses <= offset)
+				maxclasses *= 2;
+			if ((tmp = (unsigned char *) realloc(phead_locus->classes, maxclasses)) == NULL)
+				return VCF_ENOMEM;
+			phead_locus->classes = tmp;
+			phead_locus->maxclasses = maxclasses;
+		}
+		while (phead_locus->nclasses < offset)
+			phead_locus->classes[phead_locus->nclasses++] = PAIR_UNINFORMATIVE;
+		phead_locus->classes[offset] = Classify_pair(&pairs[k]);
+		if (offset >= phead_locus->nclasses)
+			phead_locus->nclasses = offset + 1;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Close_blocks {{{
+int Close_blocks(LD_BLOCKS *pblocks)
+{
+	int status = VCF_OK;
+
+	if (pblocks->open)
+		status = write_block(pblocks);
+
+	for (size_t i = 0; i < pblocks->loci.maxslots; i++)
+		free(((BLOCK_LOCUS *) Ring_slot(&pblocks->loci, i))->classes);
+	Close_ring(&pblocks->loci);
+
+	return status;
+}
+// }}}
+
+// Classify_pair {{{
+int Classify_pair(const LD_PAIR *ppair)
+{
+	double low, high;
+
+	if (ppair->n == 0 || isnan(ppair->D_lewontin))
+		return PAIR_UNINFORMATIVE;
+
+	dprime_interval(ppair, &low, &high);
+	if (low >= BLOCK_STRONG_LOW && high >= BLOCK_STRONG_HIGH)
+		return PAIR_STRONG;
+	if (high < BLOCK_RECOMB_HIGH)
+		return PAIR_RECOMB;
+	return PAIR_UNINFORMATIVE;
+}
+// }}}
+
+// block_locus {{{
+
+/* Returns the record of a locus, adding to the ring, cleared, the loci up
+ * to it; NULL if memory failure. Each slot keeps its classes buffer. */
+static BLOCK_LOCUS *block_locus(LD_BLOCKS *pblocks, unsigned long seq)
+{
+	BLOCK_LOCUS *plocus;
+
+	if (pblocks->loci.nslots == 0)
+		pblocks->loci.first_seq = seq;
+
+	while (seq >= pblocks->loci.first_seq + pblocks->loci.nslots)
+	{
+		if ((plocus = (BLOCK_LOCUS *) Ring_push(&pblocks->loci)) == NULL)
+			return NULL;
+		plocus->bound.seq = pblocks->loci.first_seq + pblocks->loci.nslots - 1;
+		plocus->bound.pos = 0;
+		plocus->bound.id[0] = '\0';
+		plocus->nclasses = 0;
+		plocus->nstrong = plocus->nrecomb = 0;
+	}
+
+	return (BLOCK_LOCUS *) Ring_at(&pblocks->loci, seq);
+}
+// }}}
+
+// drop_block_loci {{{
+
+/* Forgets the loci which cannot pair with a locus at pos, nor any after it. */
+static void drop_block_loci(LD_BLOCKS *pblocks, unsigned long pos)
+{
+	BLOCK_LOCUS *plocus;
+
+	while (pblocks->loci.nslots > 0)
+	{
+		plocus = (BLOCK_LOCUS *) Ring_at(&pblocks->loci, pblocks->loci.first_seq);
+		if (plocus->bound.pos + pblocks->winlen >= pos)
+			break;
+		Ring_pop(&pblocks->loci);
+	}
+}
+// }}}
+
+// write_block {{{
+static int write_block(LD_BLOCKS *pblocks)
+{
+	pblocks->open = false;
+	pblocks->floor_seq = pblocks->end.seq + 1;
+
+	if (fprintf(pblocks->out, "%lu\t%lu\t%s\t%s\t%lu\n",
+				pblocks->start.pos, pblocks->end.pos,
+				pblocks->start.id, pblocks->end.id,
+				pblocks->end.seq - pblocks->start.seq + 1) < 0)
+		return VCF_EIO;
+
+	return VCF_OK;
+}
+// }}}
+
+// dprime_interval {{{
+
+/* Bounds the 90% confidence interval of |D'| by its likelihood on a grid
+ * from 0 to 1, given the haplotype frequencies, as Haploview does. */
+static void dprime_interval(const LD_PAIR *ppair, double *plow, double *phigh)
+{
+	double p_A = ppair->p_A, p_B = ppair->p_B, p_AB = ppair->p_AB;
+	double loglik[DPRIME_STEPS + 1], lik[DPRIME_STEPS + 1];
+	double Dmax, f_AB, f_Ab, f_aB, f_ab, max, total, sum;
+	int i;
+
+	// Flip the alleles of the second locus so that D is positive
+	if (p_AB < p_A * p_B)
+	{
+		p_AB = p_A - p_AB;
+		p_B = 1 - p_B;
+	}
+	Dmax = (p_A*(1-p_B) <= (1-p_A)*p_B) ? p_A*(1-p_B) : (1-p_A)*p_B;
+
+	max = -INFINITY;
+	for (i = 0; i <= DPRIME_STEPS; i++)
+	{
+		f_AB = p_A*p_B + Dmax * i / DPRIME_STEPS;
+		f_Ab = fmax(p_A - f_AB, MIN_FREQ);
+		f_aB = fmax(p_B - f_AB, MIN_FREQ);
+		f_ab = fmax(1 - p_A - p_B + f_AB, MIN_FREQ);
+		f_AB = fmax(f_AB, MIN_FREQ);
+		loglik[i] = ppair->n * (p_AB * log(f_AB) + (p_A - p_AB) * log(f_Ab)
+								+ (p_B - p_AB) * log(f_aB)
+								+ (1 - p_A - p_B + p_AB) * log(f_ab));
+		if (loglik[i] > max)
+			max = loglik[i];
+	}
+	total = 0;
+	for (i = 0; i <= DPRIME_STEPS; i++)
+		total += lik[i] = exp(loglik[i] - max);
+
+	sum = 0;
+	for (i = 0; i <= DPRIME_STEPS && (sum += lik[i]) <= DPRIME_TAIL * total; i++)
+		;
+	*plow = (double) (i > 0 ? i - 1 : 0) / DPRIME_STEPS;
+
+	sum = 0;
+	for (i = DPRIME_STEPS; i >= 0 && (sum += lik[i]) <= DPRIME_TAIL * total; i--)
+		;
+	*phigh = (double) (i < DPRIME_STEPS ? i + 1 : DPRIME_STEPS) / DPRIME_STEPS;
+}
+// }}}
@@ -0,0 +1,79 @@
+/* Interface definition
+ *
+ * Find haplotype blocks while the window slides, as defined by Gabriel et
+ * al. (2002).
+ *
+ * Each pair of loci is classified by the 90% confidence interval of its
+ * D': strong LD if the interval lies in [0.7, 1] and reaches 0.98, strong
+ * evidence of recombination if it stays under 0.9, uninformative otherwise.
+ * A block is a run of loci whose outermost pair is in strong LD and whose
+ * informative pairs are in strong LD at least 95% of the times.
+ *
+ * The pairs among the loci up to a head are all known once it is the head,
+ * so the blocks ending at the head are checked then. The candidate block
+ * grows while its loci can still pair with the head and is written once
+ * they cannot; overlapping candidates give way to the longest. Only the
+ * loci within the window behind the head are kept.
+ */
+
+#ifndef _LD_BLOCKS_H_
+#define _LD_BLOCKS_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "ld_vcf.h"
+#include "seq_ring.h"
+
+#define BLOCK_STRONG_LOW 0.70 // lowest lower bound of D' in strong LD
+#define BLOCK_STRONG_HIGH 0.98 // lowest upper bound of D' in strong LD
+#define BLOCK_RECOMB_HIGH 0.90 // upper bound of D' under which it recombines
+#define BLOCK_MIN_STRONG 0.95 // fraction of informative pairs in strong LD
+
+enum pair_class { PAIR_UNINFORMATIVE, PAIR_STRONG, PAIR_RECOMB };
+
+typedef struct block_bound {
+	unsigned long seq;
+	unsigned long pos;
+	char id[MAXIDLEN];
+} BLOCK_BOUND;
+
+typedef struct block_locus {
+	BLOCK_BOUND bound;
+	unsigned char *classes; // class of the pair with each next locus
+	size_t nclasses, maxclasses;
+	unsigned long nstrong; // pairs in strong LD from it up to the head
+	unsigned long nrecomb; // recombining pairs from it up to the head
+} BLOCK_LOCUS;
+
+typedef struct ld_blocks {
+	FILE *out;
+	int winlen;
+	SEQ_RING loci; // BLOCK_LOCUS records
+	unsigned long floor_seq; // blocks start here or after, past the last one
+	bool open; // whether there is a candidate block
+	BLOCK_BOUND start, end; // the candidate block
+} LD_BLOCKS;
+
+/* operation:		starts finding blocks.
+ * precondition:	out is open for writing; winlen is that of the window.
+ * postcondition:	the blocks will be written to out. */
+void Open_blocks(LD_BLOCKS *pblocks, FILE *out, int winlen);
+
+/* operation:		adds the pairs of a head and writes the blocks which
+ * 					can no longer grow.
+ * precondition:	an LD_SINK whose sink_data is open blocks.
+ * postcondition:	returns VCF_OK, VCF_ENOMEM or VCF_EIO. */
+int Block_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+			   void *sink_data);
+
+/* operation:		writes the last block and stops finding blocks.
+ * precondition:	pblocks is open.
+ * postcondition:	returns VCF_OK or VCF_EIO; frees the memory. */
+int Close_blocks(LD_BLOCKS *pblocks);
+
+/* operation:		classifies a pair by the confidence interval of its D'.
+ * precondition:	ppair is a pair of biallelic loci.
+ * postcondition:	returns an enum pair_class. */
+int Classify_pair(const LD_PAIR *ppair);
+
+#endif
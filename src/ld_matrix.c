@@ -0,0 +1,475 @@
+/* Interface implementation */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ld_matrix.h"
+
+/* A locus of the table and its ID, to sort them by ID. */
+typedef struct locus_id {
+	const char *id;
+	uint64_t index;
+} LOCUS_ID;
+
+static int add_loci(LD_MATRIX_WRITER *pwriter, const VCF_LOCUS *phead);
+static int add_rows(LD_MATRIX_WRITER *pwriter, uint64_t nrows);
+static int copy_file(FILE *from, FILE *to);
+static int write_byid(LD_MATRIX_WRITER *pwriter);
+static int compare_ids(const void *p1, const void *p2);
+static bool header_is_valid(const LDM_HEADER *ph, size_t map_len);
+static uint64_t search_loci(const LD_MATRIX *pmatrix, uint64_t lo, uint64_t hi, uint64_t pos);
+
+
+// Open_matrix_writer {{{
+int Open_matrix_writer(LD_MATRIX_WRITER *pwriter, FILE *out, double r2_cutoff)
+{
+	LDM_HEADER header;
+
+	memset(pwriter, 0, sizeof(LD_MATRIX_WRITER));
+	pwriter->out = out;
+	pwriter->r2_cutoff = r2_cutoff;
+
+	// The header is written again, complete, when the writer is closed.
+	memset(&header, 0, sizeof(LDM_HEADER));
+	if (fwrite(&header, sizeof(LDM_HEADER), 1, out) != 1)
+		return VCF_EIO;
+
+	pwriter->loci_file = tmpfile();
+	pwriter->rows_file = tmpfile();
+	pwriter->ids_file = tmpfile();
+	if (pwriter->loci_file == NULL || pwriter->rows_file == NULL || pwriter->ids_file == NULL)
+	{
+		Close_matrix_writer(pwriter);
+		return VCF_EIO;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Matrix_sink {{{
+int Matrix_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+				void *sink_data)
+{
+	LD_MATRIX_WRITER *pwriter = (LD_MATRIX_WRITER *) sink_data;
+	LDM_ENTRY entry;
+	int status;
+
+	if ((status = add_loci(pwriter, phead)) != VCF_OK)
+		return status;
+	if ((status = add_rows(pwriter, phead->seq + 1)) != VCF_OK)
+		return status;
+
+	// Pairs come in column order; only the alt-alt one of each is stored.
+	for (size_t k = 0; k < npairs; k++)
+	{
+		if (pairs[k].alnum1 != 1 || pairs[k].alnum2 != 1)
+			continue;
+		if (isnan(pairs[k].r_squared) || pairs[k].r_squared < pwriter->r2_cutoff)
+			continue;
+
+		entry.col = (uint32_t) pairs[k].plocus2->seq;
+		entry.r2 = (uint16_t) lround(fmin(fmax(pairs[k].r_squared, 0), 1) * LDM_R2_SCALE);
+		entry.dprime = isnan(pairs[k].D_lewontin) ? 0
+			: (int16_t) lround(fmin(fmax(pairs[k].D_lewontin, -1), 1) * LDM_DPRIME_SCALE);
+		if (fwrite(&entry, sizeof(LDM_ENTRY), 1, pwriter->out) != 1)
+			return VCF_EIO;
+		pwriter->nentries++;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Close_matrix_writer {{{
+int Close_matrix_writer(LD_MATRIX_WRITER *pwriter)
+{
+	LDM_HEADER header;
+	uint64_t nblocks = (pwriter->nloci + LDM_BLOCK - 1) / LDM_BLOCK;
+	int status = VCF_OK;
+
+	if (pwriter->loci_file == NULL || pwriter->rows_file == NULL || pwriter->ids_file == NULL)
+		status = VCF_EIO;
+
+	// The rows of the loci that were never a head are empty.
+	if (status == VCF_OK)
+		status = add_rows(pwriter, pwriter->nloci + 1);
+
+	memset(&header, 0, sizeof(LDM_HEADER));
+	memcpy(header.magic, LDM_MAGIC, sizeof(header.magic));
+	header.version = LDM_VERSION;
+	header.block = LDM_BLOCK;
+	header.nloci = pwriter->nloci;
+	header.nentries = pwriter->nentries;
+	header.loci_offset = sizeof(LDM_HEADER) + pwriter->nentries * sizeof(LDM_ENTRY);
+	header.rows_offset = header.loci_offset + pwriter->nloci * sizeof(LDM_LOCUS);
+	header.blocks_offset = header.rows_offset + (pwriter->nloci + 1) * sizeof(uint64_t);
+	header.byid_offset = header.blocks_offset + nblocks * sizeof(uint64_t);
+	header.ids_offset = header.byid_offset + pwriter->nloci * sizeof(uint64_t);
+	header.ids_len = pwriter->ids_len;
+
+	if (status == VCF_OK)
+		status = copy_file(pwriter->loci_file, pwriter->out);
+	if (status == VCF_OK)
+		status = copy_file(pwriter->rows_file, pwriter->out);
+	if (status == VCF_OK && nblocks > 0
+			&& fwrite(pwriter->blocks, sizeof(uint64_t), nblocks, pwriter->out) != nblocks)
+		status = VCF_EIO;
+	if (status == VCF_OK)
+		status = write_byid(pwriter);
+	if (status == VCF_OK)
+		status = copy_file(pwriter->ids_file, pwriter->out);
+	if (status == VCF_OK && (fseek(pwriter->out, 0, SEEK_SET) != 0
+			|| fwrite(&header, sizeof(LDM_HEADER), 1, pwriter->out) != 1
+			|| fflush(pwriter->out) != 0))
+		status = VCF_EIO;
+
+	if (pwriter->loci_file != NULL)
+		fclose(pwriter->loci_file);
+	if (pwriter->rows_file != NULL)
+		fclose(pwriter->rows_file);
+	if (pwriter->ids_file != NULL)
+		fclose(pwriter->ids_file);
+	free(pwriter->blocks);
+	pwriter->loci_file = pwriter->rows_file = pwriter->ids_file = NULL;
+	pwriter->blocks = NULL;
+
+	return status;
+}
+// }}}
+
+// Open_matrix {{{
+int Open_matrix(LD_MATRIX *pmatrix, const char *path)
+{
+	const LDM_HEADER *ph;
+	const unsigned char *base;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return VCF_EIO;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return VCF_EIO;
+	}
+	if ((size_t) st.st_size < sizeof(LDM_HEADER))
+	{
+		close(fd);
+		return VCF_EMALFORMED;
+	}
+	pmatrix->map_len = st.st_size;
+	pmatrix->map = mmap(NULL, pmatrix->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pmatrix->map == MAP_FAILED)
+		return VCF_EIO;
+
+	base = (const unsigned char *) pmatrix->map;
+	ph = pmatrix->header = (const LDM_HEADER *) base;
+	if (!header_is_valid(ph, pmatrix->map_len))
+	{
+		Close_matrix(pmatrix);
+		return VCF_EMALFORMED;
+	}
+	pmatrix->entries = (const LDM_ENTRY *) (base + sizeof(LDM_HEADER));
+	pmatrix->loci = (const LDM_LOCUS *) (base + ph->loci_offset);
+	pmatrix->rows = (const uint64_t *) (base + ph->rows_offset);
+	pmatrix->blocks = (const uint64_t *) (base + ph->blocks_offset);
+	pmatrix->byid = (const uint64_t *) (base + ph->byid_offset);
+	pmatrix->ids = (const char *) (base + ph->ids_offset);
+
+	return VCF_OK;
+}
+// }}}
+
+// header_is_valid {{{
+
+/* The sections follow one another with the lengths that the header gives,
+ * the last one ending the file; the counts are bounded by the length of
+ * the file first, so that the offsets cannot overflow. */
+static bool header_is_valid(const LDM_HEADER *ph, size_t map_len)
+{
+	uint64_t nblocks, offset;
+
+	if (memcmp(ph->magic, LDM_MAGIC, sizeof(ph->magic)) != 0
+			|| ph->version != LDM_VERSION || ph->block != LDM_BLOCK)
+		return false;
+	if (ph->nentries > map_len / sizeof(LDM_ENTRY)
+			|| ph->nloci > map_len / sizeof(LDM_LOCUS))
+		return false;
+	nblocks = (ph->nloci + LDM_BLOCK - 1) / LDM_BLOCK;
+
+	offset = sizeof(LDM_HEADER) + ph->nentries * sizeof(LDM_ENTRY);
+	if (ph->loci_offset != offset)
+		return false;
+	offset += ph->nloci * sizeof(LDM_LOCUS);
+	if (ph->rows_offset != offset)
+		return false;
+	offset += (ph->nloci + 1) * sizeof(uint64_t);
+	if (ph->blocks_offset != offset)
+		return false;
+	offset += nblocks * sizeof(uint64_t);
+	if (ph->byid_offset != offset)
+		return false;
+	offset += ph->nloci * sizeof(uint64_t);
+	if (ph->ids_offset != offset || offset > map_len
+			|| ph->ids_len != map_len - offset)
+		return false;
+
+	// the IDs are searched with strcmp(), so the last one must end
+	if (ph->ids_len == 0)
+		return ph->nloci == 0;
+	return ((const char *) ph)[map_len - 1] == '\0';
+}
+// }}}
+
+// Close_matrix {{{
+void Close_matrix(LD_MATRIX *pmatrix)
+{
+	munmap(pmatrix->map, pmatrix->map_len);
+	pmatrix->map = NULL;
+	pmatrix->map_len = 0;
+}
+// }}}
+
+// Matrix_locus_at {{{
+
+/* The block index tells in which block the first locus at or after pos
+ * lies, then the loci of that block are searched. */
+uint64_t Matrix_locus_at(const LD_MATRIX *pmatrix, uint64_t pos)
+{
+	uint64_t nloci = pmatrix->header->nloci;
+	uint64_t nblocks = (nloci + LDM_BLOCK - 1) / LDM_BLOCK;
+	uint64_t lo = 0, hi = nblocks, mid;
+
+	// first block starting at or after pos
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (pmatrix->blocks[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+
+	hi = (lo * LDM_BLOCK < nloci) ? lo * LDM_BLOCK : nloci;
+	return search_loci(pmatrix, (lo - 1) * LDM_BLOCK, hi, pos);
+}
+// }}}
+
+// Matrix_locus_id {{{
+
+/* Loci with the same ID are sorted by index, so the first of them found
+ * is the first in the file. */
+uint64_t Matrix_locus_id(const LD_MATRIX *pmatrix, const char *id)
+{
+	uint64_t nloci = pmatrix->header->nloci;
+	uint64_t lo = 0, hi = nloci, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(pmatrix->ids + pmatrix->loci[pmatrix->byid[mid]].id, id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < nloci && strcmp(pmatrix->ids + pmatrix->loci[pmatrix->byid[lo]].id, id) == 0)
+		return pmatrix->byid[lo];
+	return nloci;
+}
+// }}}
+
+// Matrix_entry {{{
+const LDM_ENTRY *Matrix_entry(const LD_MATRIX *pmatrix, uint64_t i, uint64_t j)
+{
+	uint64_t lo, hi, mid, tmp;
+
+	if (i == j)
+		return NULL;
+	if (i > j)
+	{
+		tmp = i;
+		i = j;
+		j = tmp;
+	}
+
+	lo = pmatrix->rows[i];
+	hi = pmatrix->rows[i+1];
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (pmatrix->entries[mid].col < j)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < pmatrix->rows[i+1] && pmatrix->entries[lo].col == j)
+		return &pmatrix->entries[lo];
+	return NULL;
+}
+// }}}
+
+// add_loci {{{
+
+/* Walks the window from its head and adds to the locus table the loci that
+ * are not there yet, so that the index of a locus is its seq, whether or
+ * not it ever pairs or heads a row. */
+static int add_loci(LD_MATRIX_WRITER *pwriter, const VCF_LOCUS *phead)
+{
+	const VCF_LOCUS *plocus;
+	LDM_LOCUS locus;
+	uint64_t *tmp;
+	size_t idlen;
+
+	for (plocus = phead; plocus != NULL; plocus = plocus->next)
+	{
+		if (plocus->seq < pwriter->nloci)
+			continue;
+
+		if (pwriter->nloci % LDM_BLOCK == 0)
+		{
+			if (pwriter->nloci / LDM_BLOCK >= pwriter->maxblocks)
+			{
+				pwriter->maxblocks = (pwriter->maxblocks == 0) ? 64 : 2 * pwriter->maxblocks;
+				tmp = (uint64_t *) realloc(pwriter->blocks, pwriter->maxblocks * sizeof(uint64_t));
+				if (tmp == NULL)
+					return VCF_ENOMEM;
+				pwriter->blocks = tmp;
+			}
+			pwriter->blocks[pwriter->nloci / LDM_BLOCK] = plocus->pos;
+		}
+
+		locus.pos = plocus->pos;
+		locus.id = pwriter->ids_len;
+		idlen = strlen(plocus->id) + 1;
+		if (fwrite(&locus, sizeof(LDM_LOCUS), 1, pwriter->loci_file) != 1
+				|| fwrite(plocus->id, 1, idlen, pwriter->ids_file) != idlen)
+			return VCF_EIO;
+		pwriter->ids_len += idlen;
+		pwriter->nloci++;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// add_rows {{{
+
+/* Writes the offsets of the rows up to nrows, all starting at the current
+ * entry: the ones before the last are empty. */
+static int add_rows(LD_MATRIX_WRITER *pwriter, uint64_t nrows)
+{
+	uint64_t offset = pwriter->nentries;
+
+	while (pwriter->nrows < nrows)
+	{
+		if (fwrite(&offset, sizeof(uint64_t), 1, pwriter->rows_file) != 1)
+			return VCF_EIO;
+		pwriter->nrows++;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// copy_file {{{
+static int copy_file(FILE *from, FILE *to)
+{
+	char buf[BUFSIZ];
+	size_t nread;
+
+	rewind(from);
+	while ((nread = fread(buf, 1, BUFSIZ, from)) > 0)
+		if (fwrite(buf, 1, nread, to) != nread)
+			return VCF_EIO;
+
+	return ferror(from) ? VCF_EIO : VCF_OK;
+}
+// }}}
+
+// write_byid {{{
+
+/* Reads the IDs back, which follow one another in the order of the loci,
+ * and writes the loci sorted by them. */
+static int write_byid(LD_MATRIX_WRITER *pwriter)
+{
+	LOCUS_ID *byid = NULL;
+	char *ids = NULL, *p;
+	int status = VCF_OK;
+
+	if (pwriter->nloci == 0)
+		return VCF_OK;
+	ids = (char *) malloc(pwriter->ids_len);
+	byid = (LOCUS_ID *) malloc(pwriter->nloci * sizeof(LOCUS_ID));
+	if (ids == NULL || byid == NULL)
+		status = VCF_ENOMEM;
+	else
+	{
+		rewind(pwriter->ids_file);
+		if (fread(ids, 1, pwriter->ids_len, pwriter->ids_file) != pwriter->ids_len)
+			status = VCF_EIO;
+	}
+
+	if (status == VCF_OK)
+	{
+		p = ids;
+		for (uint64_t i = 0; i < pwriter->nloci; i++)
+		{
+			byid[i].id = p;
+			byid[i].index = i;
+			p += strlen(p) + 1;
+		}
+		qsort(byid, pwriter->nloci, sizeof(LOCUS_ID), compare_ids);
+		for (uint64_t i = 0; i < pwriter->nloci && status == VCF_OK; i++)
+			if (fwrite(&byid[i].index, sizeof(uint64_t), 1, pwriter->out) != 1)
+				status = VCF_EIO;
+	}
+
+	free(ids);
+	free(byid);
+	return status;
+}
+// }}}
+
+// compare_ids {{{
+static int compare_ids(const void *p1, const void *p2)
+{
+	const LOCUS_ID *plocus1 = (const LOCUS_ID *) p1;
+	const LOCUS_ID *plocus2 = (const LOCUS_ID *) p2;
+	int c = strcmp(plocus1->id, plocus2->id);
+
+	if (c != 0)
+		return c;
+	return (plocus1->index > plocus2->index) - (plocus1->index < plocus2->index);
+}
+// }}}
+
+// search_loci {{{
+
+/* Returns the first locus in [lo, hi) at or after pos, or hi. */
+static uint64_t search_loci(const LD_MATRIX *pmatrix, uint64_t lo, uint64_t hi, uint64_t pos)
+{
+	uint64_t mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (pmatrix->loci[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+// }}}
@@ -0,0 +1,137 @@
+/* Interface definition
+ *
+ * Store the linkage of a window scan as a sparse matrix, and query it.
+ *
+ * The matrix has a row and a column per locus, in file order, and keeps the
+ * upper triangle only: row i holds the loci paired with locus i after it.
+ * Each entry is the alt-alt pair of the two loci with r^2 and D' quantised
+ * to 16 bits. The file, in the byte order of the machine that wrote it, is
+ *
+ * 		header		LDM_HEADER
+ * 		entries		nentries LDM_ENTRY, row after row, columns ascending
+ * 		loci		nloci LDM_LOCUS, positions ascending
+ * 		rows		nloci+1 uint64_t, first entry of each row
+ * 		blocks		uint64_t position of every LDM_BLOCK-th locus
+ * 		byid		nloci uint64_t, the loci in the order of their IDs
+ * 		ids			the IDs of the loci, '\0'-terminated
+ *
+ * so that a reader can mmap it and jump to the rows it needs: the small
+ * block index narrows a position down to LDM_BLOCK loci, an ID is bisected
+ * in byid, and a row is found from its offset and searched by column.
+ */
+
+#ifndef _LD_MATRIX_H_
+#define _LD_MATRIX_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "ld_vcf.h"
+
+#define LDM_MAGIC "LDMATRIX"
+#define LDM_VERSION 2
+#define LDM_BLOCK 256 // loci per block of the index
+#define LDM_R2_SCALE 65535 // r^2 of 1
+#define LDM_DPRIME_SCALE 32767 // D' of 1
+
+typedef struct ldm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block; // loci per block of the index
+	uint64_t nloci;
+	uint64_t nentries;
+	uint64_t loci_offset;
+	uint64_t rows_offset;
+	uint64_t blocks_offset;
+	uint64_t byid_offset;
+	uint64_t ids_offset;
+	uint64_t ids_len;
+} LDM_HEADER;
+
+typedef struct ldm_entry {
+	uint32_t col; // the locus paired with the row
+	uint16_t r2; // r^2 * LDM_R2_SCALE
+	int16_t dprime; // D' * LDM_DPRIME_SCALE
+} LDM_ENTRY;
+
+typedef struct ldm_locus {
+	uint64_t pos;
+	uint64_t id; // offset of the ID among the ids
+} LDM_LOCUS;
+
+/* The writer is a result sink: the entries go straight to the file, the
+ * loci and rows to temporary files, until Close_matrix_writer() puts them
+ * together. */
+typedef struct ld_matrix_writer {
+	FILE *out; // must be seekable
+	FILE *loci_file;
+	FILE *rows_file;
+	FILE *ids_file;
+	uint64_t nloci; // loci in the locus table so far
+	uint64_t nrows; // rows whose offset is written
+	uint64_t nentries;
+	uint64_t ids_len;
+	uint64_t *blocks; // position of every LDM_BLOCK-th locus
+	size_t maxblocks;
+	double r2_cutoff; // entries below this r^2 are left out
+} LD_MATRIX_WRITER;
+
+/* A matrix file mapped in memory. */
+typedef struct ld_matrix {
+	void *map;
+	size_t map_len;
+	const LDM_HEADER *header;
+	const LDM_ENTRY *entries;
+	const LDM_LOCUS *loci;
+	const uint64_t *rows;
+	const uint64_t *blocks;
+	const uint64_t *byid;
+	const char *ids;
+} LD_MATRIX;
+
+/* operation:		starts writing a matrix.
+ * precondition:	out is a file open for writing, and seekable.
+ * postcondition:	returns VCF_OK or an error code. */
+int Open_matrix_writer(LD_MATRIX_WRITER *pwriter, FILE *out, double r2_cutoff);
+
+/* operation:		adds the row of a head locus to the matrix.
+ * precondition:	an LD_SINK whose sink_data is an open writer.
+ * postcondition:	returns VCF_OK or an error code. */
+int Matrix_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+				void *sink_data);
+
+/* operation:		completes the matrix file.
+ * precondition:	pwriter is open.
+ * postcondition:	writes the tables and the header and frees the
+ * 					writer, but does not close out; returns VCF_OK or
+ * 					an error code. */
+int Close_matrix_writer(LD_MATRIX_WRITER *pwriter);
+
+/* operation:		maps a matrix file in memory.
+ * precondition:	path names a file written by a matrix writer.
+ * postcondition:	returns VCF_OK, VCF_EIO, or VCF_EMALFORMED if the
+ * 					sections do not fit the header or the file. */
+int Open_matrix(LD_MATRIX *pmatrix, const char *path);
+
+/* operation:		unmaps a matrix file.
+ * precondition:	pmatrix is open.
+ * postcondition:	the memory is released. */
+void Close_matrix(LD_MATRIX *pmatrix);
+
+/* operation:		finds the first locus at or after a position.
+ * precondition:	pmatrix is open.
+ * postcondition:	returns its index, nloci if there is none. */
+uint64_t Matrix_locus_at(const LD_MATRIX *pmatrix, uint64_t pos);
+
+/* operation:		finds a locus by ID.
+ * precondition:	pmatrix is open.
+ * postcondition:	returns the index of the first locus with that ID,
+ * 					nloci if there is none. */
+uint64_t Matrix_locus_id(const LD_MATRIX *pmatrix, const char *id);
+
+/* operation:		looks up the entry of two loci.
+ * precondition:	pmatrix is open; i and j are loci of it.
+ * postcondition:	returns the entry, NULL if the pair was not stored. */
+const LDM_ENTRY *Matrix_entry(const LD_MATRIX *pmatrix, uint64_t i, uint64_t j);
+
+#endif
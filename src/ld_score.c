@@ -0,0 +1,230 @@
+/* Interface implementation */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ld_score.h"
+
+static double *locus_scores(LD_SCORES *pscores, unsigned long seq);
+static double locus_maf(const VCF_LOCUS *plocus);
+static int maf_bin(const LD_SCORES *pscores, double maf);
+static double annotation(const LD_SCORES *pscores, unsigned long pos);
+static int compare_annots(const void *p1, const void *p2);
+
+
+// Open_ld_scores {{{
+int Open_ld_scores(LD_SCORES *pscores, FILE *out, const double *maf_bounds,
+				   int nbounds)
+{
+	if (nbounds < 0 || nbounds >= MAXMAFBINS)
+		return VCF_EMALFORMED;
+	for (int b = 1; b < nbounds; b++)
+		if (maf_bounds[b] <= maf_bounds[b-1])
+			return VCF_EMALFORMED;
+
+	memset(pscores, 0, sizeof(LD_SCORES));
+	pscores->out = out;
+	pscores->nbins = nbounds + 1;
+	memcpy(pscores->maf_bounds, maf_bounds, nbounds * sizeof(double));
+	Open_ring(&pscores->acc, pscores->nbins * sizeof(double));
+
+	return VCF_OK;
+}
+// }}}
+
+// Load_annotation {{{
+int Load_annotation(LD_SCORES *pscores, FILE *annot_file)
+{
+	struct annot {
+		unsigned long pos;
+		double weight;
+	} *annots = NULL, *tmp;
+	size_t n = 0, maxannots = 0;
+	unsigned long pos;
+	double weight;
+	int nread;
+
+	while ((nread = fscanf(annot_file, "%lu%lf", &pos, &weight)) == 2)
+	{
+		if (n == maxannots)
+		{
+			maxannots = (maxannots == 0) ? 1024 : 2 * maxannots;
+			if ((tmp = realloc(annots, maxannots * sizeof(*annots))) == NULL)
+			{
+				free(annots);
+				return VCF_ENOMEM;
+			}
+			annots = tmp;
+		}
+		annots[n].pos = pos;
+		annots[n].weight = weight;
+		n++;
+	}
+	if (nread != EOF)
+	{
+		free(annots);
+		return VCF_EMALFORMED;
+	}
+	qsort(annots, n, sizeof(*annots), compare_annots);
+
+	free(pscores->annot_pos);
+	free(pscores->annot_weights);
+	pscores->annot_pos = (unsigned long *) malloc((n + 1) * sizeof(unsigned long));
+	pscores->annot_weights = (double *) malloc((n + 1) * sizeof(double));
+	if (pscores->annot_pos == NULL || pscores->annot_weights == NULL)
+	{
+		free(annots);
+		return VCF_ENOMEM;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		pscores->annot_pos[i] = annots[i].pos;
+		pscores->annot_weights[i] = annots[i].weight;
+	}
+	pscores->nannots = n;
+
+	free(annots);
+	return VCF_OK;
+}
+// }}}
+
+// Ld_score_sink {{{
+int Ld_score_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+				  void *sink_data)
+{
+	LD_SCORES *pscores = (LD_SCORES *) sink_data;
+	const VCF_LOCUS *plocus2;
+	double *head_scores, *scores2;
+	double w_head, maf_head, r2;
+	int bin_head;
+
+	// Loci before the head which never were the head (before the start of
+	// a shard) are dropped.
+	while (pscores->acc.nslots > 0 && pscores->acc.first_seq < phead->seq)
+		Ring_pop(&pscores->acc);
+	if (pscores->acc.nslots == 0)
+		pscores->acc.first_seq = phead->seq;
+
+	if ((head_scores = locus_scores(pscores, phead->seq)) == NULL)
+		return VCF_ENOMEM;
+	maf_head = locus_maf(phead);
+	bin_head = maf_bin(pscores, maf_head);
+	w_head = annotation(pscores, phead->pos);
+
+	// the locus itself
+	head_scores[bin_head] += w_head;
+
+	// Only the pair of the last alleles counts, in case all were paired.
+	for (size_t k = 0; k < npairs; k++)
+	{
+		plocus2 = pairs[k].plocus2;
+		if (pairs[k].alnum1 != (int) Nalleles_in_locus(phead) - 1
+				|| pairs[k].alnum2 != (int) Nalleles_in_locus(plocus2) - 1)
+			continue;
+		r2 = pairs[k].r_squared;
+		if (isnan(r2))
+			continue;
+
+		if ((scores2 = locus_scores(pscores, plocus2->seq)) == NULL)
+			return VCF_ENOMEM;
+		head_scores = locus_scores(pscores, phead->seq); // the ring may have moved
+		head_scores[maf_bin(pscores, locus_maf(plocus2))] += annotation(pscores, plocus2->pos) * r2;
+		scores2[bin_head] += w_head * r2;
+	}
+
+	if (fprintf(pscores->out, "%lu\t%s\t%f", phead->pos, phead->id, maf_head) < 0)
+		return VCF_EIO;
+	for (int b = 0; b < pscores->nbins; b++)
+		fprintf(pscores->out, "\t%f", head_scores[b]);
+	if (fputc('\n', pscores->out) == EOF)
+		return VCF_EIO;
+
+	// The head is done.
+	Ring_pop(&pscores->acc);
+
+	return VCF_OK;
+}
+// }}}
+
+// Close_ld_scores {{{
+void Close_ld_scores(LD_SCORES *pscores)
+{
+	Close_ring(&pscores->acc);
+	free(pscores->annot_pos);
+	free(pscores->annot_weights);
+	pscores->annot_pos = NULL;
+	pscores->annot_weights = NULL;
+}
+// }}}
+
+// locus_scores {{{
+
+/* Returns the partial scores of a locus, adding to the ring, zeroed, the
+ * loci up to it; NULL if memory failure. */
+static double *locus_scores(LD_SCORES *pscores, unsigned long seq)
+{
+	double *scores;
+
+	while (seq >= pscores->acc.first_seq + pscores->acc.nslots)
+	{
+		if ((scores = (double *) Ring_push(&pscores->acc)) == NULL)
+			return NULL;
+		memset(scores, 0, pscores->nbins * sizeof(double));
+	}
+
+	return (double *) Ring_at(&pscores->acc, seq);
+}
+// }}}
+
+// locus_maf {{{
+static double locus_maf(const VCF_LOCUS *plocus)
+{
+	double af;
+
+	af = Allele_freq(Nalleles_in_locus(plocus) - 1, plocus);
+	return (af <= 0.5) ? af : 1 - af;
+}
+// }}}
+
+// maf_bin {{{
+static int maf_bin(const LD_SCORES *pscores, double maf)
+{
+	int b = 0;
+
+	while (b < pscores->nbins - 1 && maf >= pscores->maf_bounds[b])
+		b++;
+
+	return b;
+}
+// }}}
+
+// annotation {{{
+static double annotation(const LD_SCORES *pscores, unsigned long pos)
+{
+	size_t lo = 0, hi = pscores->nannots, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (pscores->annot_pos[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < pscores->nannots && pscores->annot_pos[lo] == pos)
+		return pscores->annot_weights[lo];
+	return 1;
+}
+// }}}
+
+// compare_annots {{{
+static int compare_annots(const void *p1, const void *p2)
+{
+	unsigned long pos1 = *(const unsigned long *) p1;
+	unsigned long pos2 = *(const unsigned long *) p2;
+
+	return (pos1 > pos2) - (pos1 < pos2);
+}
+// }}}
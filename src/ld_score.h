@@ -0,0 +1,62 @@
+/* Interface definition
+ *
+ * Compute LD scores while the window slides.
+ *
+ * The LD score of a locus is the sum of its r^2 with every locus within the
+ * window on either side, itself included (r^2 = 1). Each pair adds its r^2
+ * to both its loci; a locus has seen all its pairs once it has been the
+ * head, since the loci before it paired with it when they were the head,
+ * so its score is written then. Only the loci still in the window are kept.
+ *
+ * The scores can be stratified by the minor allele frequency of the partner
+ * and weighted by an annotation of the partner: with bins B and weights w,
+ * the score of locus j in bin b is the sum of w_k r^2_jk over the loci k
+ * whose MAF falls in b.
+ */
+
+#ifndef _LD_SCORE_H_
+#define _LD_SCORE_H_
+#include <stddef.h>
+#include <stdio.h>
+#include "ld_vcf.h"
+#include "seq_ring.h"
+
+#define MAXMAFBINS 16
+
+typedef struct ld_scores {
+	FILE *out;
+	int nbins; // number of MAF bins, 1 if not stratified
+	double maf_bounds[MAXMAFBINS - 1]; // upper bounds of all the bins but the last
+	unsigned long *annot_pos; // positions with an annotation, ascending
+	double *annot_weights; // weight of each position; others weigh 1
+	size_t nannots;
+	SEQ_RING acc; // nbins partial scores per locus
+} LD_SCORES;
+
+/* operation:		starts computing LD scores.
+ * precondition:	out is open for writing; the nbounds maf_bounds are
+ * 					ascending and cut the MAF into nbounds+1 bins
+ * 					(nbounds < MAXMAFBINS, possibly 0).
+ * postcondition:	returns VCF_OK or VCF_EMALFORMED. */
+int Open_ld_scores(LD_SCORES *pscores, FILE *out, const double *maf_bounds,
+				   int nbounds);
+
+/* operation:		reads the annotation weights of the loci.
+ * precondition:	annot_file has a position and a weight per line.
+ * postcondition:	returns VCF_OK, VCF_ENOMEM or VCF_EMALFORMED. */
+int Load_annotation(LD_SCORES *pscores, FILE *annot_file);
+
+/* operation:		adds the pairs of a head to the scores and writes the
+ * 					score of the head, which is now complete.
+ * precondition:	an LD_SINK whose sink_data is open LD scores.
+ * postcondition:	returns VCF_OK, VCF_ENOMEM or VCF_EIO. */
+int Ld_score_sink(const VCF_LOCUS *phead, const LD_PAIR *pairs, size_t npairs,
+				  void *sink_data);
+
+/* operation:		stops computing LD scores.
+ * precondition:	pscores is open.
+ * postcondition:	frees the memory; the loci that never were the head
+ * 					(past the end of a shard) are not written. */
+void Close_ld_scores(LD_SCORES *pscores);
+
+#endif
@@ -3,37 +3,100 @@
 // TODO close fds and free malloc'd memory.
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "ld_vcf.h"
+#include "vcf_reader.h"
+#include "../includes/bit_utils.h"
 #include "../includes/io_utils.h"
 #include "../includes/type_utils.h"
 
-static VCF_LOCUS buflocus;
+/* 64-bit words per allele in a tile of haplotypes: a tile of the head and
+ * one of its partner, two alleles each, take 16 KB and sit in L1. */
+#define TILE_WORDS 512
+
+/* An allele is rare if it is carried in at most one word in RARE_RATIO: a
+ * sparse pass over those words then beats a dense one over all of them. */
+#define RARE_RATIO 8
+
+/* Partners counted at once by the dense kernel, sharing each word of the
+ * head. */
+#define BATCH_PARTNERS 4
+
+/* The kernels counting the pairs of the head: any loci, with their missing
+ * haplotypes; loci called everywhere, which only need the haplotypes
+ * carrying both alt alleles; and those of them with a rare alt allele. */
+enum pair_kernel { KERNEL_MISSING, KERNEL_DENSE, KERNEL_RARE, NKERNELS };
 
 static bool enqueue_locus(VCF_LOCUS locus, VCF_WINDOW *pwindow);
 static bool dequeue_locus(VCF_WINDOW *pwindow);
-
-/* digest_line() returns 0 on success, -1 at EOF, 1 if memory failure,
- * and 2 when the line is malformed. */
-static int digest_line(VCF_LOCUS *plocus, FILE *vcf_file);
+static int fill_from_buffer(VCF_WINDOW *pwindow);
+static bool reserve_pairs(VCF_WINDOW *pwindow, size_t npairs);
+static bool reserve_partners(VCF_WINDOW *pwindow, size_t npartners);
+
+static void count_words(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						size_t w0, size_t w1, LD_COUNTS *pcounts);
+static int pair_kernel(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2);
+static void count_dense(const VCF_LOCUS *plocus1, const VCF_LOCUS **partners,
+						const size_t *batch, size_t nbatch, size_t w0, size_t w1,
+						LD_COUNTS *counts);
+static void count_rare(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+					   LD_COUNTS *pcounts);
+static void count_called(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						 LD_COUNTS *pcounts);
+static bool list_alt_words(VCF_LOCUS *plocus);
+static void finish_counts(LD_COUNTS *pcounts);
+static void count_sketches(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						   LD_COUNTS *pcounts);
+static double counts_r_squared(const LD_COUNTS *pcounts);
+
+static bool build_sketch(const VCF_WINDOW *pwindow, VCF_LOCUS *plocus);
+static int compare_haps(const void *ph1, const void *ph2);
+
+/* digest_line() and parse_line() return VCF_OK on success, VCF_EOF at the end of the file,
+ * VCF_ENOMEM if memory failure, and VCF_EMALFORMED when the line is
+ * malformed. */
+static int digest_line(VCF_WINDOW *pwindow, VCF_LOCUS *plocus);
+static int digest_first_line(VCF_WINDOW *pwindow);
+static int parse_line(VCF_LOCUS *plocus, char *line, const void *parse_data);
+static int reread_buffer(VCF_WINDOW *pwindow, long offset);
+static int reparse_buffer(VCF_WINDOW *pwindow);
+static int split_header(VCF_WINDOW *pwindow);
+static void discard_locus(VCF_LOCUS *plocus);
+static char *skip_field(char *p);
+static char *cut_field(char **pp);
 static void vomit_line(const VCF_LOCUS *plocus);
 
 static VCF_ALLELE *make_allele(const char *seq, int alnum);
-static VCF_SAMPLE *make_sample(int m, int p, bool phased);
 static void free_alleles(VCF_LOCUS *plocus);
-static void free_samples(VCF_LOCUS *plocus);
+static void free_genotypes(VCF_LOCUS *plocus);
 
-static bool locus_is_in_window(const VCF_LOCUS *plocus, const VCF_WINDOW *pwindow);
-static bool locus_is_valid(const VCF_LOCUS *plocus);
+static size_t locus_memory(const VCF_LOCUS *plocus);
+static void enforce_budget(VCF_WINDOW *pwindow);
+static bool compress_locus(VCF_WINDOW *pwindow, VCF_LOCUS *plocus);
+static bool expand_locus(VCF_WINDOW *pwindow, VCF_LOCUS *plocus);
+static const uint64_t *genotype_bits(VCF_WINDOW *pwindow, const VCF_LOCUS *plocus);
+static unsigned char *pack_genotypes(const VCF_LOCUS *plocus, size_t *plen);
+static void unpack_genotypes(const VCF_LOCUS *plocus, uint64_t *bits);
 
-static void foreach_subfield(void (*fn)(char *subfield, VCF_LOCUS *plocus), const char *field, char sep, VCF_LOCUS *plocus);
-static void parse_ac(char *subfield, VCF_LOCUS *plocus);
-static void parse_af(char *subfield, VCF_LOCUS *plocus);
-static void parse_vt(char *subfield, VCF_LOCUS *plocus);
-static void parse_alt_seq(char *subfield, VCF_LOCUS *plocus);
-static void parse_info(char *subfield, VCF_LOCUS *plocus);
+static bool locus_is_in_window(const VCF_LOCUS *plocus, const VCF_WINDOW *pwindow);
+static bool locus_is_valid(const VCF_LOCUS *plocus, const VCF_WINDOW *pwindow);
+static bool fields_pass(const VCF_LOCUS *plocus, const LOCUS_FILTERS *pfilters);
+static bool counts_pass(const VCF_LOCUS *plocus, const LOCUS_FILTERS *pfilters);
+static bool name_is_listed(const char *name, char **names, size_t nnames);
+static int compare_names(const void *pname1, const void *pname2);
+
+/* foreach_subfield() and the parse_*() functions return VCF_OK or an error
+ * code, the first of which stops the iteration. */
+static int foreach_subfield(int (*fn)(char *subfield, VCF_LOCUS *plocus), const char *field, char sep, VCF_LOCUS *plocus);
+static int parse_ac(char *subfield, VCF_LOCUS *plocus);
+static int parse_af(char *subfield, VCF_LOCUS *plocus);
+static int parse_vt(char *subfield, VCF_LOCUS *plocus);
+static int parse_alt_seq(char *subfield, VCF_LOCUS *plocus);
+static int parse_info(char *subfield, VCF_LOCUS *plocus);
 
 static int compare_loci(VCF_LOCUS *plocus1, VCF_LOCUS *plocus2);
 
@@ -49,16 +112,24 @@ static int compare_loci(VCF_LOCUS *plocus1, VCF_LOCUS *plocus2);
  * locus, so that first the line is read into the buffer, then the
  * buffer is read and the decision whether to add the locus to the
  * window is taken, and if the buffer is emptied we read a new line from
- * the file.
+ * the file. The buffer belongs to the window, so that each window can
+ * inch through its own file.
  */
-void Initialize_window(VCF_WINDOW *pwindow, FILE *vcf_file, int winlen) {
+int Initialize_window(VCF_WINDOW *pwindow, FILE *vcf_file, int winlen)
+{
 	char line[3];
+	size_t maxheader = 0;
 	int status;
 
-	// Discard header lines from the file
+	// Discard header lines from the file, but for the names of the samples
+	pwindow->header = NULL;
+	pwindow->samples = NULL;
+	pwindow->nsamples = 0;
 	while (fgets(line, 3, vcf_file) != NULL && strcmp(line, "##") == 0)
 		EATLINE(vcf_file);
-	EATLINE(vcf_file);
+	status = (getline(&pwindow->header, &maxheader, vcf_file) >= 0)
+		? split_header(pwindow) : VCF_OK;
+	pwindow->bufoffset = ftell(vcf_file);
 
 	// Initialize the window
 	pwindow->head = pwindow->tail = NULL;
@@ -66,107 +137,387 @@ void Initialize_window(VCF_WINDOW *pwindow, FILE *vcf_file, int winlen) {
 	pwindow->winlen = winlen;
 	pwindow->vcf_file = vcf_file;
 	pwindow->eow = false;
+	pwindow->pairs = NULL;
+	pwindow->maxpairs = 0;
+	pwindow->memory = 0;
+	pwindow->max_memory = 0;
+	pwindow->mem_level = VCF_MEM_EXPANDED;
+	pwindow->ncompressed = 0;
+	pwindow->pcompress = NULL;
+	pwindow->scratch = NULL;
+	pwindow->maxscratch = 0;
+	pwindow->partners = NULL;
+	pwindow->counts = NULL;
+	pwindow->batches = NULL;
+	pwindow->maxpartners = 0;
+	pwindow->sketch_haps = NULL;
+	pwindow->sketch_len = 0;
+	pwindow->sketch_verify = 2;
+	pwindow->start = 0;
+	pwindow->end = ULONG_MAX;
+	pwindow->nenqueued = 0;
+	pwindow->all_alleles = false;
+	pwindow->line = NULL;
+	pwindow->maxline = 0;
+	pwindow->firstline = NULL;
+	pwindow->nthreads = 1;
+	pwindow->preader = NULL;
+	memset(&pwindow->filters, 0, sizeof(LOCUS_FILTERS));
+	pwindow->filters.max_missing = 1;
+	pwindow->kept_before = NULL;
 
 	// Initialize the buffer pointers
-	buflocus.alleles = NULL;
-	buflocus.samples = NULL;
+	pwindow->buflocus.alleles = NULL;
+	pwindow->buflocus.gt.bits = NULL;
+	pwindow->buflocus.gt.packed = NULL;
+	pwindow->buflocus.gt.alt_words = NULL;
+	pwindow->buflocus.sketch.bits = NULL;
+	if (status != VCF_OK)
+		return status;
+
+	// Digest the first data line into the one-locus buffer; loci are
+	// added to the window by Fill_window(), once it is configured.
+	if ((status = digest_first_line(pwindow)) != VCF_OK)
+	{
+		pwindow->eow = true;
+		return (status == VCF_EOF) ? VCF_ENODATA : status;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Slide_window {{{
+int Slide_window(VCF_WINDOW *pwindow)
+{
+	// Remove the first locus
+	if (pwindow->nloci != 0)
+		dequeue_locus(pwindow);
+
+	// Add new locus if appropriate
+	return fill_from_buffer(pwindow);
+}
+// }}}
+
+// Limit_window_memory {{{
+void Limit_window_memory(VCF_WINDOW *pwindow, size_t max_memory)
+{
+	pwindow->max_memory = max_memory;
+	enforce_budget(pwindow);
+}
+// }}}
 
-	// Digest the first data line into the one-locus buffer
-	if ((status = digest_line(&buflocus, pwindow->vcf_file)) != 0)
+// Sketch_window {{{
+
+/* The subsample is drawn once, from the haplotypes of the first locus, by
+ * a partial Fisher-Yates shuffle driven by xorshift64*; loci with fewer
+ * haplotypes just miss the ones they lack. */
+int Sketch_window(VCF_WINDOW *pwindow, unsigned long nhaps, double verify_r2,
+				  unsigned long seed)
+{
+	unsigned long *haps, tmp, nall, k;
+	uint64_t x;
+
+	nall = pwindow->buflocus.gt.nhaps;
+	if (nhaps > nall)
+		nhaps = nall;
+	if ((haps = (unsigned long *) malloc(nall * sizeof(unsigned long))) == NULL)
+		return VCF_ENOMEM;
+	for (unsigned long h = 0; h < nall; h++)
+		haps[h] = h;
+
+	x = seed ? seed : 1;
+	for (unsigned long i = 0; i < nhaps; i++)
 	{
-		if (status == -1)
-		{
-			fputs("ERROR: no data found in the vcf file.", stderr);
-			exit(EXIT_FAILURE);
-		}
-		else if (status == 1)
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		k = i + (x * UINT64_C(2685821657736338717)) % (nall - i);
+		tmp = haps[i];
+		haps[i] = haps[k];
+		haps[k] = tmp;
+	}
+	qsort(haps, nhaps, sizeof(unsigned long), compare_haps);
+
+	free(pwindow->sketch_haps);
+	pwindow->sketch_haps = haps;
+	pwindow->sketch_len = nhaps;
+	pwindow->sketch_verify = verify_r2;
+
+	return VCF_OK;
+}
+// }}}
+
+// Restrict_window {{{
+int Restrict_window(VCF_WINDOW *pwindow, unsigned long start,
+					unsigned long end, long offset)
+{
+	pwindow->start = start;
+	pwindow->end = end;
+	if (offset < 0)
+		return VCF_OK;
+
+	return reread_buffer(pwindow, offset);
+}
+// }}}
+
+// Filter_window {{{
+
+/* The samples are marked by the number kept before each column, so that
+ * the haplotypes of a kept sample are found without a search and the
+ * others are skipped as they are read. */
+int Filter_window(VCF_WINDOW *pwindow, const LOCUS_FILTERS *pfilters)
+{
+	char **include = NULL, **exclude = NULL;
+	bool keep, masked = (pwindow->kept_before != NULL);
+	int status;
+
+	pwindow->filters = *pfilters;
+	pwindow->filters.include = pwindow->filters.exclude = NULL;
+	pwindow->filters.ninclude = pwindow->filters.nexclude = 0;
+	free(pwindow->kept_before);
+	pwindow->kept_before = NULL;
+
+	if (pfilters->include != NULL || pfilters->nexclude > 0)
+	{
+		// Sorted copies of the lists, to search them
+		include = (char **) malloc((pfilters->ninclude + 1) * sizeof(char *));
+		exclude = (char **) malloc((pfilters->nexclude + 1) * sizeof(char *));
+		pwindow->kept_before = (unsigned long *) malloc((pwindow->nsamples + 1) * sizeof(unsigned long));
+		if (include == NULL || exclude == NULL || pwindow->kept_before == NULL)
 		{
-			fputs("ERROR: we ran out of memory.", stderr);
-			exit(EXIT_FAILURE);
+			free(include);
+			free(exclude);
+			free(pwindow->kept_before);
+			pwindow->kept_before = NULL;
+			return VCF_ENOMEM;
 		}
-		else
+		if (pfilters->ninclude > 0)
+			memcpy(include, pfilters->include, pfilters->ninclude * sizeof(char *));
+		if (pfilters->nexclude > 0)
+			memcpy(exclude, pfilters->exclude, pfilters->nexclude * sizeof(char *));
+		qsort(include, pfilters->ninclude, sizeof(char *), compare_names);
+		qsort(exclude, pfilters->nexclude, sizeof(char *), compare_names);
+
+		pwindow->kept_before[0] = 0;
+		for (unsigned long c = 0; c < pwindow->nsamples; c++)
 		{
-			fputs("ERROR: malformed VCF.", stderr);
-			exit(EXIT_FAILURE);
+			keep = (pfilters->include == NULL
+					|| name_is_listed(pwindow->samples[c], include, pfilters->ninclude))
+				&& !name_is_listed(pwindow->samples[c], exclude, pfilters->nexclude);
+			pwindow->kept_before[c+1] = pwindow->kept_before[c] + keep;
 		}
+		free(include);
+		free(exclude);
 	}
 
-	// Add loci to the window.
-	while (locus_is_in_window(&buflocus, pwindow) && !pwindow->eow)
+	// The buffered locus has the bits of the samples kept before: it is
+	// parsed again only if they change, else just checked.
+	if (pwindow->eow)
+		return VCF_OK;
+	if (masked || pwindow->kept_before != NULL)
+		return reparse_buffer(pwindow);
+	if (fields_pass(&pwindow->buflocus, &pwindow->filters)
+			&& counts_pass(&pwindow->buflocus, &pwindow->filters))
+		return VCF_OK;
+	free_alleles(&pwindow->buflocus);
+	free_genotypes(&pwindow->buflocus);
+	if ((status = digest_line(pwindow, &pwindow->buflocus)) != VCF_OK)
 	{
-		// filters for quality, number of alleles...
-		if (locus_is_valid(&buflocus))
-			// Add valid locus
-			if (!enqueue_locus(buflocus, pwindow))
+		pwindow->eow = true;
+		return (status == VCF_EOF) ? VCF_OK : status;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Parse_window_threads {{{
+void Parse_window_threads(VCF_WINDOW *pwindow, int nthreads)
+{
+	pwindow->nthreads = (nthreads > 1) ? nthreads : 1;
+}
+// }}}
+
+// Pair_all_alleles {{{
+void Pair_all_alleles(VCF_WINDOW *pwindow, bool all_alleles)
+{
+	pwindow->all_alleles = all_alleles;
+}
+// }}}
+
+// Fill_window {{{
+int Fill_window(VCF_WINDOW *pwindow)
+{
+	int status = VCF_OK;
+
+	// If we opened a window with less than two loci, we try again.
+	while (pwindow->nloci < 2 && !pwindow->eow && status == VCF_OK)
+		status = Slide_window(pwindow);
+
+	return status;
+}
+// }}}
+
+// Compute_head_ld {{{
+
+/* The partners are first sorted into batches by the kernel that suits
+ * them, so that each kernel runs over its whole batch with no branch per
+ * pair. They are counted a tile of haplotypes at a time, so that the tile
+ * of the head stays in the cache while the same tile of every partner
+ * streams past it; the counts of each partner accumulate across tiles. The
+ * rare ones are only read where the rarer locus has its alt allele, which
+ * is scattered over the tiles, hence they are counted whole, as are the
+ * compressed partners, expanded into the scratch space one at a time.
+ */
+int Compute_head_ld(VCF_WINDOW *pwindow, LD_SINK sink, void *sink_data)
+{
+	VCF_LOCUS *plocus1, *plocus2;
+	VCF_LOCUS expanded2; // plocus2 with its genotypes expanded
+	LD_COUNTS *pcounts;
+	LD_PAIR *ppair;
+	size_t npartners = 0, npairs = 0;
+	size_t nbatch[NKERNELS] = {0}, first[NKERNELS], *batch;
+	int kernel;
+
+	plocus1 = pwindow->head;
+
+	// The head is paired with every other locus, so it stays expanded.
+	if (!expand_locus(pwindow, plocus1))
+		return VCF_ENOMEM;
+	enforce_budget(pwindow);
+
+	// the loci must be biallelic in order for our formulae to work
+	if (Nalleles_in_locus(plocus1) <= 2)
+		for (plocus2 = plocus1->next; plocus2 != NULL; plocus2 = plocus2->next)
+			if (Nalleles_in_locus(plocus2) <= 2)
 			{
-				fputs("ERROR: could not add locus to the window.", stderr);
-				exit(EXIT_FAILURE);
+				if (!reserve_partners(pwindow, npartners + 1))
+					return VCF_ENOMEM;
+				pwindow->partners[npartners] = plocus2;
+				memset(&pwindow->counts[npartners], 0, sizeof(LD_COUNTS));
+				npartners++;
 			}
 
-		// Read the next line into the buffer
-		if ((status = digest_line(&buflocus, pwindow->vcf_file)) != 0)
+	// Estimate the pairs on the sketches, but count exactly the ones
+	// that look linked enough to be worth it.
+	if (pwindow->sketch_len > 0)
+		for (size_t k = 0; k < npartners; k++)
 		{
-			if (status == -1)
-			{
-				pwindow->eow = true;
-				return; // here the fact that the vcf has ended is not a problem.
-			}
-			else if (status == 1)
-			{
-				fputs("ERROR: we ran out of memory.", stderr);
-				exit(EXIT_FAILURE);
-			}
-			else
+			count_sketches(plocus1, pwindow->partners[k], &pwindow->counts[k]);
+			if (counts_r_squared(&pwindow->counts[k]) >= pwindow->sketch_verify)
+				memset(&pwindow->counts[k], 0, sizeof(LD_COUNTS));
+		}
+
+	// Sort the expanded partners still to count by kernel.
+	for (size_t k = 0; k < npartners; k++)
+		if (!pwindow->counts[k].sketched && pwindow->partners[k]->gt.bits != NULL)
+			nbatch[pair_kernel(plocus1, pwindow->partners[k])]++;
+	first[0] = 0;
+	for (kernel = 1; kernel < NKERNELS; kernel++)
+		first[kernel] = first[kernel-1] + nbatch[kernel-1];
+	for (size_t k = 0; k < npartners; k++)
+		if (!pwindow->counts[k].sketched && pwindow->partners[k]->gt.bits != NULL)
+		{
+			kernel = pair_kernel(plocus1, pwindow->partners[k]);
+			pwindow->batches[first[kernel]++] = k;
+		}
+	for (kernel = 0; kernel < NKERNELS; kernel++)
+		first[kernel] -= nbatch[kernel];
+
+	for (size_t w0 = 0; w0 < plocus1->gt.nwords; w0 += TILE_WORDS)
+	{
+		batch = pwindow->batches + first[KERNEL_MISSING];
+		for (size_t b = 0; b < nbatch[KERNEL_MISSING]; b++)
+			count_words(plocus1, pwindow->partners[batch[b]], w0, w0 + TILE_WORDS,
+						&pwindow->counts[batch[b]]);
+		count_dense(plocus1, pwindow->partners, pwindow->batches + first[KERNEL_DENSE],
+					nbatch[KERNEL_DENSE], w0, w0 + TILE_WORDS, pwindow->counts);
+	}
+	batch = pwindow->batches + first[KERNEL_RARE];
+	for (size_t b = 0; b < nbatch[KERNEL_RARE]; b++)
+		count_rare(plocus1, pwindow->partners[batch[b]], &pwindow->counts[batch[b]]);
+	for (size_t b = first[KERNEL_DENSE]; b < first[KERNEL_RARE] + nbatch[KERNEL_RARE]; b++)
+		count_called(plocus1, pwindow->partners[pwindow->batches[b]],
+					 &pwindow->counts[pwindow->batches[b]]);
+
+	for (size_t k = 0; k < npartners; k++)
+	{
+		if (pwindow->counts[k].sketched)
+			continue;
+		if (pwindow->partners[k]->gt.bits == NULL)
+		{
+			expanded2 = *pwindow->partners[k];
+			if ((expanded2.gt.bits = (uint64_t *) genotype_bits(pwindow, pwindow->partners[k])) == NULL)
+				return VCF_ENOMEM;
+			count_words(plocus1, &expanded2, 0, plocus1->gt.nwords, &pwindow->counts[k]);
+		}
+		finish_counts(&pwindow->counts[k]);
+	}
+
+	for (size_t k = 0; k < npartners; k++)
+	{
+		pcounts = &pwindow->counts[k];
+		// For biallelic loci r^2 is the same for all the four pairs of
+		// alleles and D only changes sign, so the alt-alt pair (the last
+		// alleles) says it all.
+		for (int i = pwindow->all_alleles ? 0 : Nalleles_in_locus(plocus1) - 1;
+				i < Nalleles_in_locus(plocus1); i++)
+			for (int j = pwindow->all_alleles ? 0 : Nalleles_in_locus(pwindow->partners[k]) - 1;
+					j < Nalleles_in_locus(pwindow->partners[k]); j++)
 			{
-				fputs("ERROR: malformed VCF.", stderr);
-				exit(EXIT_FAILURE);
+				if (!reserve_pairs(pwindow, npairs + 1))
+					return VCF_ENOMEM;
+				ppair = &pwindow->pairs[npairs++];
+				ppair->plocus1 = plocus1;
+				ppair->alnum1 = i;
+				ppair->plocus2 = pwindow->partners[k];
+				ppair->alnum2 = j;
+				ppair->p_A = (double) pcounts->c_A[i] / pcounts->n;
+				ppair->p_B = (double) pcounts->c_B[j] / pcounts->n;
+				ppair->p_AB = (double) pcounts->c_AB[i][j] / pcounts->n;
+				ppair->D = Calculate_D(ppair->p_A, ppair->p_B, ppair->p_AB);
+				ppair->D_lewontin = Calculate_D_lewontin(ppair->p_A, ppair->p_B, ppair->p_AB);
+				ppair->r_squared = Calculate_r_squared(ppair->p_A, ppair->p_B, ppair->p_AB);
+				ppair->n = pcounts->n;
+				ppair->estimated = pcounts->sketched;
+				// The correction takes weak pairs below 0, where no r^2 can
+				// be: they are clamped, so that no pair falls to the cutoff
+				// just for being estimated.
+				if (pcounts->sketched && pcounts->n > 2)
+				{
+					ppair->r_squared -= (1 - ppair->r_squared) / (pcounts->n - 2);
+					if (ppair->r_squared < 0)
+						ppair->r_squared = 0;
+				}
 			}
-		}
 	}
+
+	return (*sink)(plocus1, pwindow->pairs, npairs, sink_data);
 }
 // }}}
 
-// Slide_window {{{
-void Slide_window(VCF_WINDOW *pwindow)
+// Run_window {{{
+int Run_window(VCF_WINDOW *pwindow, LD_SINK sink, void *sink_data)
 {
 	int status;
 
-	// Remove the first locus
-	if (pwindow->nloci != 0)
-		dequeue_locus(pwindow);
+	// Fill the window, unless we were already called
+	if (pwindow->nloci == 0 && (status = Slide_window(pwindow)) != VCF_OK)
+		return status;
 
-	// Add new locus if appropriate
-	while (locus_is_in_window(&buflocus, pwindow) && !pwindow->eow)
+	// Every locus gets its turn as the head, even if it has no partners,
+	// so that the sink sees them all. The window only empties at the end
+	// of the file.
+	while (pwindow->nloci > 0 && pwindow->head->pos <= pwindow->end)
 	{
-		// filters for quality, number of alleles...
-		if (locus_is_valid(&buflocus))
-			//Add valid locus
-			if (!enqueue_locus(buflocus, pwindow))
-			{
-				fputs("ERROR: could not add locus to the window.", stderr);
-				exit(EXIT_FAILURE);
-			}
-
-		// Read the next line into the buffer
-		if ((status = digest_line(&buflocus, pwindow->vcf_file)) != 0)
-		{
-			if (status == -1)
-			{
-				pwindow->eow = true;
-				return;
-			}
-			else if (status == 1)
-			{
-				fputs("ERROR: we ran out of memory.", stderr);
-				exit(EXIT_FAILURE);
-			}
-			else
-			{
-				fputs("ERROR: malformed VCF line.", stderr);
-				exit(EXIT_FAILURE);
-			}
-		}
+		if ((status = Compute_head_ld(pwindow, sink, sink_data)) != VCF_OK)
+			return status;
+		if ((status = Slide_window(pwindow)) != VCF_OK)
+			return status;
 	}
+
+	return VCF_OK;
 }
 // }}}
 
@@ -175,6 +526,70 @@ void Close_window(VCF_WINDOW *pwindow)
 {
 	while (pwindow->nloci > 0)
 		dequeue_locus(pwindow);
+
+	free_alleles(&pwindow->buflocus);
+	free_genotypes(&pwindow->buflocus);
+	free(pwindow->pairs);
+	pwindow->pairs = NULL;
+	pwindow->maxpairs = 0;
+	free(pwindow->scratch);
+	pwindow->scratch = NULL;
+	pwindow->maxscratch = 0;
+	free(pwindow->partners);
+	free(pwindow->counts);
+	free(pwindow->batches);
+	pwindow->partners = NULL;
+	pwindow->counts = NULL;
+	pwindow->batches = NULL;
+	pwindow->maxpartners = 0;
+	free(pwindow->sketch_haps);
+	pwindow->sketch_haps = NULL;
+	pwindow->sketch_len = 0;
+	if (pwindow->preader != NULL)
+	{
+		Close_reader(pwindow->preader);
+		free(pwindow->preader);
+		pwindow->preader = NULL;
+	}
+	free(pwindow->line);
+	free(pwindow->firstline);
+	pwindow->line = NULL;
+	pwindow->firstline = NULL;
+	pwindow->maxline = 0;
+	free(pwindow->header);
+	free(pwindow->samples);
+	free(pwindow->kept_before);
+	pwindow->header = NULL;
+	pwindow->samples = NULL;
+	pwindow->kept_before = NULL;
+	pwindow->nsamples = 0;
+}
+// }}}
+
+// Vcf_strerror {{{
+const char *Vcf_strerror(int status)
+{
+	switch (status)
+	{
+		case VCF_OK:
+			return "success";
+		case VCF_FILTERED:
+			return "locus left out by the filters";
+		case VCF_EOF:
+			return "end of the vcf file";
+		case VCF_ENOMEM:
+			return "we ran out of memory";
+		case VCF_EMALFORMED:
+			return "malformed VCF line";
+		case VCF_ENODATA:
+			return "no data found in the vcf file";
+		case VCF_EIO:
+			return "could not read or write a file";
+		case VCF_ESHARD:
+			return "shards are missing, repeated, overlapping or from different plans";
+		default:
+			return "unknown error";
+	}
 }
 // }}}
 
@@ -186,35 +601,50 @@ unsigned int Nalleles_in_locus(const VCF_LOCUS *plocus)
 // }}}
 
 // Linked_alleles_freq {{{
-float Linked_alleles_freq(int alnum1, const VCF_LOCUS *plocus1,
-						  int alnum2, const VCF_LOCUS *plocus2)
+double Linked_alleles_freq(int alnum1, const VCF_LOCUS *plocus1,
+						   int alnum2, const VCF_LOCUS *plocus2)
 {
-	VCF_SAMPLE *psample1, *psample2;
-	int c_AB = 0; // count
-	float p_AB; // frequency
-	int ns;
-
-	psample1 = plocus1->samples;
-	psample2 = plocus2->samples;
-	ns = (plocus1->info.ns <= plocus2->info.ns) ? plocus1->info.ns : plocus2->info.ns;
-	for (int i = 0; i < ns; i++)
+	const VCF_GENOTYPES *pgt1 = &plocus1->gt, *pgt2 = &plocus2->gt;
+	unsigned long nhaps;
+	uint64_t called1, called2, both;
+	uint64_t c_AB = 0, n = 0; // counts
+	size_t nwords;
+
+	// Only the haplotypes called at both loci are compared.
+	nhaps = (pgt1->nhaps <= pgt2->nhaps) ? pgt1->nhaps : pgt2->nhaps;
+	nwords = NWORDS(nhaps);
+	for (size_t w = 0; w < nwords; w++)
 	{
-		if (psample1->gt.m == alnum1 && psample2->gt.m == alnum2)
-			c_AB++;
-		if (psample1->gt.p == alnum1 && psample2->gt.p == alnum2)
-			c_AB++;
-		psample1 = psample1->next;
-		psample2 = psample2->next;
+		called1 = called2 = 0;
+		for (unsigned int a = 0; a < plocus1->info._an; a++)
+			called1 |= pgt1->bits[a * pgt1->nwords + w];
+		for (unsigned int a = 0; a < plocus2->info._an; a++)
+			called2 |= pgt2->bits[a * pgt2->nwords + w];
+		both = called1 & called2;
+		if (w == nwords - 1 && nhaps % 64 != 0)
+			both &= (UINT64_C(1) << (nhaps % 64)) - 1;
+
+		n += popcount64(both);
+		c_AB += popcount64(pgt1->bits[alnum1 * pgt1->nwords + w]
+						   & pgt2->bits[alnum2 * pgt2->nwords + w] & both);
 	}
 
-	p_AB = (float) c_AB / (2 * ns);
+	return (double) c_AB / n;
+}
+// }}}
 
-	return p_AB;
+// Count_linked_alleles {{{
+void Count_linked_alleles(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						  LD_COUNTS *pcounts)
+{
+	memset(pcounts, 0, sizeof(LD_COUNTS));
+	count_words(plocus1, plocus2, 0, plocus1->gt.nwords, pcounts);
+	finish_counts(pcounts);
 }
 // }}}
 
 // Allele_freq {{{
-float Allele_freq(int alnum, const VCF_LOCUS *plocus)
+double Allele_freq(int alnum, const VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *pallele;
 
@@ -231,16 +661,16 @@ float Allele_freq(int alnum, const VCF_LOCUS *plocus)
 // }}}
 
 // Calculate_D {{{
-float Calculate_D(float p_A, float p_B, float p_AB)
+double Calculate_D(double p_A, double p_B, double p_AB)
 {
 	return (p_AB - (p_A * p_B));
 }
 // }}}
 
 // Calculate_D_lewontin {{{
-float Calculate_D_lewontin(float p_A, float p_B, float p_AB)
+double Calculate_D_lewontin(double p_A, double p_B, double p_AB)
 {
-	float D, Dmax;
+	double D, Dmax;
 
 	D = p_AB - (p_A*p_B);
 /*
@@ -261,9 +691,9 @@ float Calculate_D_lewontin(float p_A, float p_B, float p_AB)
 // }}}
 
 // Calculate_r_squared {{{
-float Calculate_r_squared(float p_A, float p_B, float p_AB)
+double Calculate_r_squared(double p_A, double p_B, double p_AB)
 {
-	float D, d;
+	double D, d;
 
 	D = p_AB - (p_A*p_B);
 	d = p_A*(1-p_A) * p_B*(1-p_B);
@@ -297,6 +727,8 @@ static bool enqueue_locus(VCF_LOCUS locus, VCF_WINDOW *pwindow)
 		return false;
 
 	*pnew = locus;
+	pnew->seq = pwindow->nenqueued++;
+	pnew->next = NULL;
 	if (pwindow->head == NULL)
 		pwindow->head = pnew;
 	else
@@ -305,6 +737,7 @@ static bool enqueue_locus(VCF_LOCUS locus, VCF_WINDOW *pwindow)
 
 	if (pnew != NULL)
 		pwindow->nloci++;
+	pwindow->memory += locus_memory(pnew);
 
 	return true;
 }
@@ -321,103 +754,1017 @@ static bool dequeue_locus(VCF_WINDOW *pwindow)
 	// Remove the first locus 
 	plocus = pwindow->head;
 	pwindow->head = pwindow->head->next;
+	pwindow->memory -= locus_memory(plocus);
+	if (plocus->gt.bits == NULL)
+		pwindow->ncompressed--;
+	if (pwindow->pcompress == plocus)
+		pwindow->pcompress = NULL;
 	free_alleles(plocus);
-	free_samples(plocus);
+	free_genotypes(plocus);
 	free(plocus);
+	pwindow->nloci--;
 	if (pwindow->nloci == 0)
 		pwindow->tail = NULL;
-	pwindow->nloci--;
+
+	return true;
+}
+// }}}
+
+// fill_from_buffer {{{
+
+/* Adds to the window the buffered locus and the following ones, as long as
+ * they fall in the window. Once a locus is enqueued the window owns its
+ * alleles and genotypes, so the buffer forgets them. */
+static int fill_from_buffer(VCF_WINDOW *pwindow)
+{
+	VCF_LOCUS *pbuf = &pwindow->buflocus;
+	int status;
+
+	while (!pwindow->eow && locus_is_in_window(pbuf, pwindow))
+	{
+		// Past the last head and its window there is nothing left to read.
+		if (pbuf->pos > pwindow->end && pbuf->pos - pwindow->end > (unsigned long) pwindow->winlen)
+		{
+			free_alleles(pbuf);
+			free_genotypes(pbuf);
+			pwindow->eow = true;
+			return VCF_OK;
+		}
+
+		// filters for quality, number of alleles...
+		if (locus_is_valid(pbuf, pwindow))
+		{
+			// Add valid locus
+			if (pwindow->sketch_len > 0 && !build_sketch(pwindow, pbuf))
+				return VCF_ENOMEM;
+			if (!enqueue_locus(*pbuf, pwindow))
+				return VCF_ENOMEM;
+			pbuf->alleles = NULL;
+			pbuf->gt.bits = NULL;
+			pbuf->gt.packed = NULL;
+			pbuf->gt.alt_words = NULL;
+			pbuf->sketch.bits = NULL;
+			enforce_budget(pwindow);
+		}
+		else
+		{
+			free_alleles(pbuf);
+			free_genotypes(pbuf);
+		}
+
+		// Read the next line into the buffer
+		if ((status = digest_line(pwindow, pbuf)) != VCF_OK)
+		{
+			pwindow->eow = true;
+			// here the fact that the vcf has ended is not a problem.
+			return (status == VCF_EOF) ? VCF_OK : status;
+		}
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// reserve_partners {{{
+static bool reserve_partners(VCF_WINDOW *pwindow, size_t npartners)
+{
+	const VCF_LOCUS **tmp_partners;
+	LD_COUNTS *tmp_counts;
+	size_t *tmp_batches, maxpartners;
+
+	if (npartners <= pwindow->maxpartners)
+		return true;
+
+	maxpartners = (pwindow->maxpartners == 0) ? 16 : 2 * pwindow->maxpartners;
+	while (maxpartners < npartners)
+		maxpartners *= 2;
+	tmp_partners = (const VCF_LOCUS **) realloc(pwindow->partners, maxpartners * sizeof(VCF_LOCUS *));
+	if (tmp_partners == NULL)
+		return false;
+	pwindow->partners = tmp_partners;
+	tmp_counts = (LD_COUNTS *) realloc(pwindow->counts, maxpartners * sizeof(LD_COUNTS));
+	if (tmp_counts == NULL)
+		return false;
+	pwindow->counts = tmp_counts;
+	tmp_batches = (size_t *) realloc(pwindow->batches, maxpartners * sizeof(size_t));
+	if (tmp_batches == NULL)
+		return false;
+	pwindow->batches = tmp_batches;
+	pwindow->maxpartners = maxpartners;
+
+	return true;
+}
+// }}}
+
+// count_words {{{
+
+/* Adds to pcounts the haplotypes in words [w0, w1) of two biallelic loci.
+ * Each called haplotype carries exactly one allele, so it is enough to
+ * count the called ones and the alternate alleles here; finish_counts()
+ * derives the rest once all the words are in.
+ */
+static void count_words(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						size_t w0, size_t w1, LD_COUNTS *pcounts)
+{
+	const VCF_GENOTYPES *pgt1 = &plocus1->gt, *pgt2 = &plocus2->gt;
+	const uint64_t *ref1, *alt1, *ref2, *alt2;
+	unsigned long nhaps;
+	uint64_t a, b, both;
+	uint64_t n = 0, c_A = 0, c_B = 0, c_AB = 0;
+	size_t nwords;
+
+	nhaps = (pgt1->nhaps <= pgt2->nhaps) ? pgt1->nhaps : pgt2->nhaps;
+	nwords = NWORDS(nhaps);
+	if (w1 > nwords)
+		w1 = nwords;
+
+	ref1 = pgt1->bits;
+	alt1 = (plocus1->info._an > 1) ? pgt1->bits + pgt1->nwords : NULL;
+	ref2 = pgt2->bits;
+	alt2 = (plocus2->info._an > 1) ? pgt2->bits + pgt2->nwords : NULL;
+
+	for (size_t w = w0; w < w1; w++)
+	{
+		a = (alt1 != NULL) ? alt1[w] : 0;
+		b = (alt2 != NULL) ? alt2[w] : 0;
+		both = (ref1[w] | a) & (ref2[w] | b);
+		if (w == nwords - 1 && nhaps % 64 != 0)
+			both &= (UINT64_C(1) << (nhaps % 64)) - 1;
+		a &= both;
+		b &= both;
+
+		n += popcount64(both);
+		c_A += popcount64(a);
+		c_B += popcount64(b);
+		c_AB += popcount64(a & b);
+	}
+
+	pcounts->n += n;
+	pcounts->c_A[1] += c_A;
+	pcounts->c_B[1] += c_B;
+	pcounts->c_AB[1][1] += c_AB;
+}
+// }}}
+
+// pair_kernel {{{
+static int pair_kernel(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2)
+{
+	// all the haplotypes of both loci are called
+	if (plocus1->gt.nhaps != plocus2->gt.nhaps
+			|| plocus1->info.an != (int) plocus1->gt.nhaps
+			|| plocus2->info.an != (int) plocus2->gt.nhaps)
+		return KERNEL_MISSING;
+	if (plocus1->gt.rare || plocus2->gt.rare)
+		return KERNEL_RARE;
+	return KERNEL_DENSE;
+}
+// }}}
+
+// count_dense {{{
+
+/* Counts the haplotypes carrying both alt alleles in words [w0, w1), for a
+ * batch of partners called everywhere, as is the head. BATCH_PARTNERS of
+ * them go through each word of the head at once. */
+static void count_dense(const VCF_LOCUS *plocus1, const VCF_LOCUS **partners,
+						const size_t *batch, size_t nbatch, size_t w0, size_t w1,
+						LD_COUNTS *counts)
+{
+	const uint64_t *alt1, *alt2[BATCH_PARTNERS];
+	uint64_t c_AB[BATCH_PARTNERS], a;
+	size_t nwords = plocus1->gt.nwords, b, p, np;
+
+	if (w1 > nwords)
+		w1 = nwords;
+	alt1 = plocus1->gt.bits + (Nalleles_in_locus(plocus1) - 1) * nwords;
+
+	for (b = 0; b < nbatch; b += np)
+	{
+		np = (nbatch - b < BATCH_PARTNERS) ? nbatch - b : BATCH_PARTNERS;
+		for (p = 0; p < np; p++)
+		{
+			alt2[p] = partners[batch[b+p]]->gt.bits
+				+ (Nalleles_in_locus(partners[batch[b+p]]) - 1) * nwords;
+			c_AB[p] = 0;
+		}
+
+		if (np == BATCH_PARTNERS)
+			for (size_t w = w0; w < w1; w++)
+			{
+				a = alt1[w];
+				c_AB[0] += popcount64(a & alt2[0][w]);
+				c_AB[1] += popcount64(a & alt2[1][w]);
+				c_AB[2] += popcount64(a & alt2[2][w]);
+				c_AB[3] += popcount64(a & alt2[3][w]);
+			}
+		else
+			for (size_t w = w0; w < w1; w++)
+				for (p = 0; p < np; p++)
+					c_AB[p] += popcount64(alt1[w] & alt2[p][w]);
+
+		for (p = 0; p < np; p++)
+			counts[batch[b+p]].c_AB[1][1] += c_AB[p];
+	}
+}
+// }}}
+
+// count_rare {{{
+
+/* Counts the haplotypes carrying both alt alleles of two loci called
+ * everywhere, in the words where the rarer of them is carried. */
+static void count_rare(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+					   LD_COUNTS *pcounts)
+{
+	const VCF_GENOTYPES *psparse = &plocus1->gt, *pdense = &plocus2->gt;
+	const uint64_t *alt1, *alt2;
+	uint64_t c_AB = 0;
+
+	if (!psparse->rare || (pdense->rare && pdense->nalt_words < psparse->nalt_words))
+	{
+		psparse = &plocus2->gt;
+		pdense = &plocus1->gt;
+	}
+	// monomorphic loci have the ref allele only
+	if (Nalleles_in_locus(plocus1) < 2 || Nalleles_in_locus(plocus2) < 2)
+		return;
+
+	alt1 = psparse->bits + psparse->nwords;
+	alt2 = pdense->bits + pdense->nwords;
+	for (size_t i = 0; i < psparse->nalt_words; i++)
+		c_AB += popcount64(alt1[psparse->alt_words[i]] & alt2[psparse->alt_words[i]]);
+
+	pcounts->c_AB[1][1] += c_AB;
+}
+// }}}
+
+// count_called {{{
+
+/* Completes the counts of two loci called everywhere: every haplotype is
+ * counted and the alt alleles are those of the loci. */
+static void count_called(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						 LD_COUNTS *pcounts)
+{
+	pcounts->n = plocus1->gt.nhaps;
+	pcounts->c_A[1] = (plocus1->info._an > 1) ? plocus1->alleles->next->ac : 0;
+	pcounts->c_B[1] = (plocus2->info._an > 1) ? plocus2->alleles->next->ac : 0;
+}
+// }}}
+
+// list_alt_words {{{
+
+/* Lists the words where the last allele of a locus is carried, if they are
+ * few enough for it to count as rare. */
+static bool list_alt_words(VCF_LOCUS *plocus)
+{
+	VCF_GENOTYPES *pgt = &plocus->gt;
+	const uint64_t *alt = pgt->bits + (Nalleles_in_locus(plocus) - 1) * pgt->nwords;
+	size_t n = 0;
+
+	pgt->rare = false;
+	pgt->alt_words = NULL;
+	pgt->nalt_words = 0;
+	if (Nalleles_in_locus(plocus) < 2)
+	{
+		pgt->rare = true;
+		return true;
+	}
+
+	for (size_t w = 0; w < pgt->nwords; w++)
+		n += (alt[w] != 0);
+	if (n * RARE_RATIO > pgt->nwords)
+		return true;
+
+	pgt->rare = true;
+	if (n == 0)
+		return true;
+	if ((pgt->alt_words = (uint32_t *) malloc(n * sizeof(uint32_t))) == NULL)
+		return false;
+	for (size_t w = 0; w < pgt->nwords; w++)
+		if (alt[w] != 0)
+			pgt->alt_words[pgt->nalt_words++] = (uint32_t) w;
+
+	return true;
+}
+// }}}
+
+// finish_counts {{{
+static void finish_counts(LD_COUNTS *pcounts)
+{
+	pcounts->c_A[0] = pcounts->n - pcounts->c_A[1];
+	pcounts->c_B[0] = pcounts->n - pcounts->c_B[1];
+	pcounts->c_AB[1][0] = pcounts->c_A[1] - pcounts->c_AB[1][1];
+	pcounts->c_AB[0][1] = pcounts->c_B[1] - pcounts->c_AB[1][1];
+	pcounts->c_AB[0][0] = pcounts->c_A[0] - pcounts->c_AB[0][1];
+}
+// }}}
+
+// count_sketches {{{
+static void count_sketches(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						   LD_COUNTS *pcounts)
+{
+	VCF_LOCUS sketch1 = *plocus1, sketch2 = *plocus2;
+
+	sketch1.gt = plocus1->sketch;
+	sketch2.gt = plocus2->sketch;
+	Count_linked_alleles(&sketch1, &sketch2, pcounts);
+	pcounts->sketched = true;
+}
+// }}}
+
+// counts_r_squared {{{
+static double counts_r_squared(const LD_COUNTS *pcounts)
+{
+	return Calculate_r_squared((double) pcounts->c_A[1] / pcounts->n,
+							   (double) pcounts->c_B[1] / pcounts->n,
+							   (double) pcounts->c_AB[1][1] / pcounts->n);
+}
+// }}}
+
+// build_sketch {{{
+
+/* Copies into the sketch the bits of the sampled haplotypes: bit k of the
+ * sketch is haplotype sketch_haps[k] of the locus. */
+static bool build_sketch(const VCF_WINDOW *pwindow, VCF_LOCUS *plocus)
+{
+	VCF_GENOTYPES *psketch = &plocus->sketch;
+	const uint64_t *bits;
+	unsigned long h;
+
+	psketch->nhaps = pwindow->sketch_len;
+	psketch->nwords = NWORDS(psketch->nhaps);
+	psketch->packed = NULL;
+	psketch->packed_len = 0;
+	psketch->incompressible = true;
+	psketch->rare = false;
+	psketch->alt_words = NULL;
+	psketch->nalt_words = 0;
+	psketch->bits = (uint64_t *) calloc(plocus->info._an * psketch->nwords, sizeof(uint64_t));
+	if (psketch->bits == NULL)
+		return false;
+
+	for (unsigned int a = 0; a < plocus->info._an; a++)
+	{
+		bits = plocus->gt.bits + a * plocus->gt.nwords;
+		for (unsigned long k = 0; k < psketch->nhaps; k++)
+		{
+			h = pwindow->sketch_haps[k];
+			if (h < plocus->gt.nhaps && (bits[h / 64] >> (h % 64) & 1))
+				psketch->bits[a * psketch->nwords + k / 64] |= UINT64_C(1) << (k % 64);
+		}
+	}
+
+	return true;
+}
+// }}}
+
+// compare_haps {{{
+static int compare_haps(const void *ph1, const void *ph2)
+{
+	unsigned long h1 = *(const unsigned long *) ph1;
+	unsigned long h2 = *(const unsigned long *) ph2;
+
+	return (h1 > h2) - (h1 < h2);
+}
+// }}}
+
+// locus_memory {{{
+static size_t locus_memory(const VCF_LOCUS *plocus)
+{
+	size_t bytes;
+
+	bytes = sizeof(VCF_LOCUS) + plocus->info._an * sizeof(VCF_ALLELE);
+	if (plocus->gt.bits != NULL)
+		bytes += plocus->info._an * plocus->gt.nwords * sizeof(uint64_t);
+	else
+		bytes += plocus->gt.packed_len;
+	if (plocus->sketch.bits != NULL)
+		bytes += plocus->info._an * plocus->sketch.nwords * sizeof(uint64_t);
+	bytes += plocus->gt.nalt_words * sizeof(uint32_t);
+
+	return bytes;
+}
+// }}}
+
+// enforce_budget {{{
+
+/* Compresses the oldest expanded loci, sparing the head, until the window
+ * is within its budget. Loci are compressed in queue order, so pcompress
+ * remembers where to resume instead of walking the compressed ones again.
+ */
+static void enforce_budget(VCF_WINDOW *pwindow)
+{
+	VCF_LOCUS *plocus, *plast = NULL;
+
+	if (pwindow->max_memory == 0 || pwindow->head == NULL)
+		return;
+
+	plocus = (pwindow->pcompress != NULL && pwindow->pcompress != pwindow->head)
+		? pwindow->pcompress : pwindow->head->next;
+	while (pwindow->memory > pwindow->max_memory && plocus != NULL)
+	{
+		if (plocus->gt.bits != NULL && !plocus->gt.incompressible)
+			if (!compress_locus(pwindow, plocus))
+				break; // no memory to compress: keep it expanded
+		plast = plocus;
+		plocus = plocus->next;
+	}
+	// past the tail, resume from it: the loci added later follow it
+	pwindow->pcompress = (plocus != NULL) ? plocus : plast;
+
+	if (pwindow->memory > pwindow->max_memory)
+		pwindow->mem_level = VCF_MEM_OVER_BUDGET;
+	else if (pwindow->ncompressed > 0 && pwindow->mem_level < VCF_MEM_COMPRESSED)
+		pwindow->mem_level = VCF_MEM_COMPRESSED;
+}
+// }}}
+
+// compress_locus {{{
+static bool compress_locus(VCF_WINDOW *pwindow, VCF_LOCUS *plocus)
+{
+	unsigned char *packed;
+	size_t len;
+
+	if ((packed = pack_genotypes(plocus, &len)) == NULL)
+		return false;
+	if (len >= plocus->info._an * plocus->gt.nwords * sizeof(uint64_t))
+	{
+		free(packed);
+		plocus->gt.incompressible = true;
+		return true;
+	}
+
+	pwindow->memory -= locus_memory(plocus);
+	free(plocus->gt.bits);
+	plocus->gt.bits = NULL;
+	plocus->gt.packed = packed;
+	plocus->gt.packed_len = len;
+	pwindow->memory += locus_memory(plocus);
+	pwindow->ncompressed++;
+
+	return true;
+}
+// }}}
+
+// expand_locus {{{
+static bool expand_locus(VCF_WINDOW *pwindow, VCF_LOCUS *plocus)
+{
+	uint64_t *bits;
+
+	if (plocus->gt.bits != NULL)
+		return true;
+
+	bits = (uint64_t *) malloc(plocus->info._an * plocus->gt.nwords * sizeof(uint64_t));
+	if (bits == NULL)
+		return false;
+	unpack_genotypes(plocus, bits);
+
+	pwindow->memory -= locus_memory(plocus);
+	free(plocus->gt.packed);
+	plocus->gt.packed = NULL;
+	plocus->gt.bits = bits;
+	pwindow->memory += locus_memory(plocus);
+	pwindow->ncompressed--;
+
+	return true;
+}
+// }}}
+
+// genotype_bits {{{
+
+/* Returns the bit sets of a locus, expanding them into the scratch space of
+ * the window if the locus is compressed; they are valid until the next
+ * call. */
+static const uint64_t *genotype_bits(VCF_WINDOW *pwindow, const VCF_LOCUS *plocus)
+{
+	size_t nwords;
+	uint64_t *tmp;
+
+	if (plocus->gt.bits != NULL)
+		return plocus->gt.bits;
+
+	nwords = plocus->info._an * plocus->gt.nwords;
+	if (nwords > pwindow->maxscratch)
+	{
+		tmp = (uint64_t *) realloc(pwindow->scratch, nwords * sizeof(uint64_t));
+		if (tmp == NULL)
+			return NULL;
+		pwindow->scratch = tmp;
+		pwindow->maxscratch = nwords;
+	}
+	unpack_genotypes(plocus, pwindow->scratch);
+
+	return pwindow->scratch;
+}
+// }}}
+
+// pack_genotypes {{{
+
+/* The compressed encoding stores, for each allele, a flag byte and the
+ * varint gaps between the haplotypes that differ from the flag: if the
+ * flag is 0 the listed haplotypes carry the allele, if it is 1 they are
+ * the only ones that do not. Rare alleles list their carriers, common
+ * ones their non-carriers, so that either kind takes little room.
+ */
+static unsigned char *pack_genotypes(const VCF_LOCUS *plocus, size_t *plen)
+{
+	const VCF_GENOTYPES *pgt = &plocus->gt;
+	const uint64_t *bits;
+	unsigned char *packed, *tmp;
+	unsigned long count, last, h;
+	size_t len = 0, maxlen;
+	uint64_t w;
+	bool flip;
+
+	maxlen = plocus->info._an * (1 + 10) + 64;
+	if ((packed = (unsigned char *) malloc(maxlen)) == NULL)
+		return NULL;
+
+	for (unsigned int a = 0; a < plocus->info._an; a++)
+	{
+		bits = pgt->bits + a * pgt->nwords;
+		count = 0;
+		for (size_t k = 0; k < pgt->nwords; k++)
+			count += popcount64(bits[k]);
+		flip = (count > pgt->nhaps / 2);
+		if (flip)
+			count = pgt->nhaps - count;
+
+		// flag, count and at most ten bytes per listed haplotype
+		if (len + 11 + 10 * count > maxlen)
+		{
+			maxlen = 2 * maxlen + 11 + 10 * count;
+			if ((tmp = (unsigned char *) realloc(packed, maxlen)) == NULL)
+			{
+				free(packed);
+				return NULL;
+			}
+			packed = tmp;
+		}
+		packed[len++] = flip;
+		len += put_varint(packed + len, count);
+
+		last = 0;
+		for (size_t k = 0; k < pgt->nwords; k++)
+		{
+			w = flip ? ~bits[k] : bits[k];
+			if (flip && k == pgt->nwords - 1 && pgt->nhaps % 64 != 0)
+				w &= (UINT64_C(1) << (pgt->nhaps % 64)) - 1;
+			while (w != 0)
+			{
+				h = k * 64 + ctz64(w);
+				len += put_varint(packed + len, h - last);
+				last = h;
+				w &= w - 1;
+			}
+		}
+	}
+
+	*plen = len;
+	return packed;
+}
+// }}}
+
+// unpack_genotypes {{{
+static void unpack_genotypes(const VCF_LOCUS *plocus, uint64_t *bits)
+{
+	const VCF_GENOTYPES *pgt = &plocus->gt;
+	const unsigned char *packed = pgt->packed;
+	unsigned long count, gap, h;
+	uint64_t *allele_bits;
+	bool flip;
+
+	for (unsigned int a = 0; a < plocus->info._an; a++)
+	{
+		allele_bits = bits + a * pgt->nwords;
+		flip = *packed++;
+		packed += get_varint(packed, &count);
+
+		memset(allele_bits, flip ? 0xff : 0, pgt->nwords * sizeof(uint64_t));
+		if (flip && pgt->nhaps % 64 != 0)
+			allele_bits[pgt->nwords - 1] = (UINT64_C(1) << (pgt->nhaps % 64)) - 1;
+
+		h = 0;
+		for (unsigned long i = 0; i < count; i++)
+		{
+			packed += get_varint(packed, &gap);
+			h += gap;
+			allele_bits[h / 64] ^= UINT64_C(1) << (h % 64);
+		}
+	}
+}
+// }}}
+
+// reserve_pairs {{{
+static bool reserve_pairs(VCF_WINDOW *pwindow, size_t npairs)
+{
+	LD_PAIR *tmp;
+	size_t maxpairs;
+
+	if (npairs <= pwindow->maxpairs)
+		return true;
+
+	maxpairs = (pwindow->maxpairs == 0) ? 64 : 2 * pwindow->maxpairs;
+	while (maxpairs < npairs)
+		maxpairs *= 2;
+	tmp = (LD_PAIR *) realloc(pwindow->pairs, maxpairs * sizeof(LD_PAIR));
+	if (tmp == NULL)
+		return false;
+	pwindow->pairs = tmp;
+	pwindow->maxpairs = maxpairs;
 
 	return true;
 }
 // }}}
 
 // digest_line {{{
-static int digest_line(VCF_LOCUS *plocus, FILE *vcf_file)
+
+/* Reads the next line of the file that passes the filters into a locus,
+ * from the threads parsing ahead if there are any, starting them at the
+ * first call. */
+static int digest_line(VCF_WINDOW *pwindow, VCF_LOCUS *plocus)
 {
-	VCF_ALLELE *newallele, *lastallele;
-	VCF_SAMPLE *newsample, *lastsample;
+	int status;
 
-	char tmp_ref_seq[SEQLEN], tmp_alt_seq[SEQLEN];
-	char tmp_filter[FILTLEN], tmp_info[INFOLEN];
-	char tmp_gt[GTLEN];
+	// The buffer moves on from the first line.
+	free(pwindow->firstline);
+	pwindow->firstline = NULL;
 
-	// XXX what about chr X and Y? are they integer?
-	if (fscanf(vcf_file, "%d%ld%s%s%s%d%s%s", &plocus->chrom, &plocus->pos,
-			&plocus->id, tmp_ref_seq, tmp_alt_seq,
-			&plocus->qual, tmp_filter, tmp_info) != 8)
+	// The window owns whatever the buffer held before.
+	plocus->alleles = NULL;
+	plocus->gt.bits = NULL;
+	plocus->gt.packed = NULL;
+	plocus->gt.alt_words = NULL;
+	plocus->sketch.bits = NULL;
+
+	if (pwindow->nthreads > 1 && pwindow->preader == NULL)
 	{
-		// The file has ended
-		return -1;
+		if ((pwindow->preader = (VCF_READER *) malloc(sizeof(VCF_READER))) == NULL)
+			return VCF_ENOMEM;
+		if ((status = Open_reader(pwindow->preader, pwindow->vcf_file,
+						pwindow->nthreads, parse_line, discard_locus, pwindow)) != VCF_OK)
+		{
+			free(pwindow->preader);
+			pwindow->preader = NULL;
+			return status;
+		}
+	}
+	if (pwindow->preader != NULL)
+		return Read_locus(pwindow->preader, plocus);
+
+	do
+	{
+		if (getline(&pwindow->line, &pwindow->maxline, pwindow->vcf_file) < 0)
+			return VCF_EOF;
+	} while ((status = parse_line(plocus, pwindow->line, pwindow)) == VCF_FILTERED);
+
+	return status;
+}
+// }}}
+
+// digest_first_line {{{
+
+/* Digests the first data line into the buffer like digest_line(), keeping
+ * its text as read, so that Filter_window() can parse it again with no
+ * need to seek back in a file which may be a pipe. */
+static int digest_first_line(VCF_WINDOW *pwindow)
+{
+	ssize_t len;
+	int status;
+
+	do
+	{
+		if ((len = getline(&pwindow->line, &pwindow->maxline, pwindow->vcf_file)) < 0)
+			return VCF_EOF;
+		free(pwindow->firstline);
+		if ((pwindow->firstline = (char *) malloc(len + 1)) == NULL)
+			return VCF_ENOMEM;
+		memcpy(pwindow->firstline, pwindow->line, len + 1);
+	} while ((status = parse_line(&pwindow->buflocus, pwindow->line, pwindow)) == VCF_FILTERED);
+
+	return status;
+}
+// }}}
+
+// reparse_buffer {{{
+
+/* Parses the buffered locus again, with the filters, from the text of the
+ * first line if it is still there, else from the file. */
+static int reparse_buffer(VCF_WINDOW *pwindow)
+{
+	int status;
+
+	if (pwindow->firstline == NULL || pwindow->preader != NULL)
+		return reread_buffer(pwindow, pwindow->bufoffset);
+
+	free_alleles(&pwindow->buflocus);
+	free_genotypes(&pwindow->buflocus);
+	// the line was read into pwindow->line, which has room for it
+	strcpy(pwindow->line, pwindow->firstline);
+	status = parse_line(&pwindow->buflocus, pwindow->line, pwindow);
+	if (status == VCF_FILTERED)
+		status = digest_line(pwindow, &pwindow->buflocus);
+	if (status != VCF_OK)
+	{
+		pwindow->eow = true;
+		return (status == VCF_EOF) ? VCF_OK : status;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// reread_buffer {{{
+
+/* Replaces the buffered locus with the one at offset, or the first after
+ * it which passes the filters; the threads, if any, start again from
+ * there. */
+static int reread_buffer(VCF_WINDOW *pwindow, long offset)
+{
+	int status;
+
+	free_alleles(&pwindow->buflocus);
+	free_genotypes(&pwindow->buflocus);
+	if (pwindow->preader != NULL)
+	{
+		Close_reader(pwindow->preader);
+		free(pwindow->preader);
+		pwindow->preader = NULL;
+	}
+	if (fseek(pwindow->vcf_file, offset, SEEK_SET) != 0)
+		return VCF_EIO;
+	pwindow->bufoffset = offset;
+	pwindow->eow = false;
+	if ((status = digest_line(pwindow, &pwindow->buflocus)) != VCF_OK)
+	{
+		pwindow->eow = true;
+		return (status == VCF_EOF) ? VCF_OK : status;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// split_header {{{
+
+/* Splits the #CHROM line, whose first characters were read already, into
+ * the names of the samples, from its tenth field on. */
+static int split_header(VCF_WINDOW *pwindow)
+{
+	char *p = pwindow->header;
+	unsigned long nfields = 1;
+
+	for (char *q = p; *q != '\0'; q++)
+		nfields += (*q == '\t');
+	if (nfields <= 9)
+		return VCF_OK;
+	pwindow->samples = (char **) malloc((nfields - 9) * sizeof(char *));
+	if (pwindow->samples == NULL)
+		return VCF_ENOMEM;
+
+	for (unsigned long f = 0; f < nfields; f++)
+	{
+		if (f >= 9)
+			pwindow->samples[pwindow->nsamples++] = p;
+		p += strcspn(p, "\t\r\n");
+		if (*p != '\0')
+			*p++ = '\0';
 	}
 
+	return VCF_OK;
+}
+// }}}
+
+// parse_line {{{
+
+/* Works on the line and the read-only settings of the window alone, so
+ * that several threads can parse at once. The fixed fields are split in
+ * place. Returns VCF_FILTERED, having freed the locus, if it does not pass
+ * the filters or the line is blank, and VCF_EMALFORMED if the fields do
+ * not parse. */
+static int parse_line(VCF_LOCUS *plocus, char *line, const void *parse_data)
+{
+	const VCF_WINDOW *pwindow = (const VCF_WINDOW *) parse_data;
+	const unsigned long *kept_before = pwindow->kept_before;
+	VCF_ALLELE *newallele, *lastallele;
+	VCF_GENOTYPES *pgt = &plocus->gt;
+	int alnum[2];
+
+	char *fields[NFIXED];
+	char *p, *endptr;
+	size_t len;
+	unsigned long h, ncols;
+	int status;
+
+	plocus->alleles = NULL;
+	pgt->bits = NULL;
+	pgt->packed = NULL;
+	pgt->packed_len = 0;
+	pgt->incompressible = false;
+	pgt->alt_words = NULL;
+	plocus->sketch.bits = NULL;
+
+	// Blank lines are skipped, whatever else must be the fixed fields.
+	p = line;
+	while (isspace(*p))
+		p++;
+	if (*p == '\0')
+		return VCF_FILTERED;
+	for (int f = 0; f < NFIXED; f++)
+		if ((fields[f] = cut_field(&p)) == NULL)
+			return VCF_EMALFORMED;
+
+	// XXX what about chr X and Y? are they integer?
+	errno = 0;
+	plocus->chrom = (int) strtol(fields[0], &endptr, 10);
+	if (*endptr != '\0' || endptr == fields[0])
+		return VCF_EMALFORMED;
+	plocus->pos = strtoul(fields[1], &endptr, 10);
+	if (*endptr != '\0' || endptr == fields[1] || errno != 0)
+		return VCF_EMALFORMED;
+	if (strlen(fields[2]) >= MAXIDLEN)
+		return VCF_EMALFORMED;
+	strcpy(plocus->id, fields[2]);
+	if (strcmp(fields[5], ".") == 0)
+		plocus->qual = -1;
+	else if ((plocus->qual = strtod(fields[5], &endptr)) < 0
+			|| *endptr != '\0' || endptr == fields[5])
+		return VCF_EMALFORMED;
+
 	// Filter
-	if (strcmp(tmp_filter, "PASS") == 0)
+	if (strcmp(fields[6], "PASS") == 0)
 		plocus->filter.pass = true;
 	else
 		plocus->filter.pass = false;
 
-	// Free the previous allocations XXX DO NOT DO THAT!!!! otherwise
-	// makeallele() is free to reallocate old locations, overwriting
-	// alleles of previous loci!!!
-	//free_alleles(plocus); free_samples(plocus);
-
 	// Allocate space for the alleles
 	plocus->info._an = 0;
-	newallele = make_allele(tmp_ref_seq, plocus->info._an++);
+	plocus->info.ns = 0;
+	plocus->info.an = 0;
+	newallele = make_allele(fields[3], plocus->info._an++);
 	if (newallele == NULL)
-		return 1;
+		return VCF_ENOMEM;
 	plocus->alleles = newallele;
 
 	// alt seq
-	foreach_subfield(parse_alt_seq, tmp_alt_seq, ',', plocus);
+	if ((status = foreach_subfield(parse_alt_seq, fields[4], ',', plocus)) != VCF_OK)
+		goto fail;
 
 	// general and alt allele info
-	foreach_subfield(parse_info, tmp_info, ';', plocus);
+	if ((status = foreach_subfield(parse_info, fields[7], ';', plocus)) != VCF_OK)
+		goto fail;
+
+	// The header tells how many samples there are; NS only counts those
+	// with data, so it is just a stand-in for a missing header.
+	ncols = (pwindow->nsamples > 0) ? pwindow->nsamples : (unsigned long) plocus->info.ns;
+	if (plocus->info.ns < 0 || ncols == 0)
+	{
+		status = VCF_EMALFORMED;
+		goto fail;
+	}
 
 	// ref allele info
-	VCF_ALLELE *ref;
-	lastallele = plocus->alleles->next; // start from the first alt allele
-	ref = plocus->alleles;
-	ref->ac = plocus->info.an;
-	ref->af = 1;
 	strcpy(plocus->alleles->vt, "REF");
-	while (lastallele != NULL)
+
+	// Loci left out by their fields are not worth decoding
+	if (!fields_pass(plocus, &pwindow->filters))
 	{
-		ref->ac -= lastallele->ac;
-		ref->af -= lastallele->af;
-		lastallele = lastallele->next;
+		status = VCF_FILTERED;
+		goto fail;
 	}
 
 	// skip one field (the format)
-	fscanf(vcf_file, "%s", tmp_gt);
+	p = skip_field(p);
 
-	// Read in the first sample
-	fscanf(vcf_file, "%s", tmp_gt);
-	newsample = make_sample(tmp_gt[0]-48, tmp_gt[2]-48, (tmp_gt[1] == '|'));
-	if (newsample == NULL)
-		return 1;
-	plocus->samples = newsample;
-	lastsample = plocus->samples;
+	// Allocate one bit set per allele, for the kept samples
+	if (kept_before != NULL && ncols > pwindow->nsamples)
+	{
+		status = VCF_EMALFORMED;
+		goto fail;
+	}
+	pgt->nhaps = 2 * (kept_before ? kept_before[ncols] : ncols);
+	pgt->nwords = NWORDS(pgt->nhaps);
+	pgt->bits = (uint64_t *) calloc(plocus->info._an * pgt->nwords, sizeof(uint64_t));
+	if (pgt->bits == NULL)
+	{
+		status = VCF_ENOMEM;
+		goto fail;
+	}
 
-	// Read the other samples
-	if (plocus->info.ns != 2504)
-		printf("%d\n",plocus->info.ns);
-	for (int i = 1; i < plocus->info.ns; i++)
+	// Read the samples
+	for (unsigned long c = 0; c < ncols; c++)
 	{
 		// XXX we assume that no locus has more than 10 alleles...
-		fscanf(vcf_file, "%s", tmp_gt);
-		newsample = make_sample(tmp_gt[0]-48, tmp_gt[2]-48, (tmp_gt[1] == '|'));
-		if (newsample == NULL)
-			return 1;
-		lastsample->next = newsample;
-		lastsample = lastsample->next;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0' || *p == '\n' || *p == '\r')
+		{
+			// the samples past the end of a short line are not called
+			if (pwindow->nsamples > 0)
+				break;
+			status = VCF_EMALFORMED;
+			goto fail;
+		}
+		if (kept_before != NULL && kept_before[c+1] == kept_before[c])
+		{
+			p = skip_field(p);
+			continue;
+		}
+		h = 2 * (kept_before ? kept_before[c] : c);
+		// only the first GTLEN characters matter, e.g. `0|1'
+		for (len = 0; len < GTLEN && p[len] != '\0' && !isspace(p[len]); len++)
+			;
+		alnum[0] = p[0]-48;
+		alnum[1] = (len == GTLEN) ? p[2]-48 : -1;
+		p = skip_field(p);
+		for (int k = 0; k < 2; k++)
+		{
+			// missing alleles (`.') are just left out
+			if (alnum[k] < 0 || alnum[k] > 9)
+				continue;
+			if ((unsigned int) alnum[k] >= plocus->info._an)
+			{
+				status = VCF_EMALFORMED;
+				goto fail;
+			}
+			pgt->bits[alnum[k] * pgt->nwords + (h+k) / 64] |= UINT64_C(1) << ((h+k) % 64);
+		}
+	}
+
+	// The counts of the INFO field give way to those of the called
+	// genotypes, which is what the linkage is computed on.
+	plocus->info.an = 0;
+	for (lastallele = plocus->alleles; lastallele != NULL; lastallele = lastallele->next)
+	{
+		lastallele->ac = 0;
+		for (size_t w = 0; w < pgt->nwords; w++)
+			lastallele->ac += popcount64(pgt->bits[lastallele->allele_num * pgt->nwords + w]);
+		plocus->info.an += lastallele->ac;
+	}
+	for (lastallele = plocus->alleles; lastallele != NULL; lastallele = lastallele->next)
+		lastallele->af = (plocus->info.an > 0) ? (double) lastallele->ac / plocus->info.an : 0;
+
+	if (!counts_pass(plocus, &pwindow->filters))
+	{
+		status = VCF_FILTERED;
+		goto fail;
+	}
+	if (!list_alt_words(plocus))
+	{
+		status = VCF_ENOMEM;
+		goto fail;
 	}
 
-	EATLINE(vcf_file);
 	//vomit_line(plocus);
 
-	return 0;
+	return VCF_OK;
+
+fail:
+	free_alleles(plocus);
+	free_genotypes(plocus);
+	return status;
+}
+// }}}
+
+// discard_locus {{{
+static void discard_locus(VCF_LOCUS *plocus)
+{
+	free_alleles(plocus);
+	free_genotypes(plocus);
+}
+// }}}
+
+// skip_field {{{
+
+/* Returns the end of the field at p, past any blanks before it. */
+static char *skip_field(char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	while (*p != '\0' && !isspace(*p))
+		p++;
+
+	return p;
+}
+// }}}
+
+// cut_field {{{
+
+/* Ends the field at *pp, past any blanks before it, where it ends on the
+ * line, and moves *pp past it. Returns the field, or NULL if the line has
+ * ended. */
+static char *cut_field(char **pp)
+{
+	char *field = *pp, *p;
+
+	while (*field == ' ' || *field == '\t')
+		field++;
+	if (*field == '\0' || isspace(*field))
+		return NULL;
+	p = skip_field(field);
+	if (*p != '\0')
+		*p++ = '\0';
+	*pp = p;
+
+	return field;
 }
 // }}}
 
@@ -425,7 +1772,6 @@ static int digest_line(VCF_LOCUS *plocus, FILE *vcf_file)
 static void vomit_line(const VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *pallele = plocus->alleles;
-	VCF_SAMPLE *psample = plocus->samples;
 
 	printf("LOCUS\n");
 	printf("chrom %d\tpos %ld\tid %s\tn_samples %d\tn_haplotypes %d\tn_alleles %d\n",
@@ -439,15 +1785,6 @@ static void vomit_line(const VCF_LOCUS *plocus)
 				pallele->ac, pallele->af, pallele->vt);
 		pallele = pallele->next;
 	}
-	/*printf("SAMPLES\n");
-	while (psample != NULL)
-	{
-		printf("%d%c%d\t", psample->gt.m, psample->phased ? '|' : '/', psample->gt.p);
-		psample = psample->next;
-	}
-	putchar('\n');
-	putchar('\n');
-	*/
 }
 // }}}
 
@@ -460,7 +1797,9 @@ static VCF_ALLELE *make_allele(const char *seq, int alnum)
 	//printf("newly created allele: %p\n", newallele);
 	if (newallele != NULL)
 	{
-		strcpy(newallele->allele_seq, seq);
+		// long alleles are only kept in part, like the types
+		strncpy(newallele->allele_seq, seq, SEQLEN - 1);
+		newallele->allele_seq[SEQLEN - 1] = '\0';
 		newallele->allele_num = alnum;
 		newallele->ac = -1;
 		newallele->af = -1;
@@ -472,24 +1811,6 @@ static VCF_ALLELE *make_allele(const char *seq, int alnum)
 }
 // }}}
 
-// make_sample {{{
-static VCF_SAMPLE *make_sample(int m, int p, bool phased)
-{
-	VCF_SAMPLE *newsample;
-
-	newsample = (VCF_SAMPLE *) malloc(sizeof(VCF_SAMPLE));
-	if (newsample != NULL)
-	{
-		newsample->gt.m = m;
-		newsample->gt.p = p;
-		newsample->phased = phased;
-		newsample->next = NULL;
-	}
-
-	return newsample;
-}
-// }}}
-
 // free_alleles {{{
 static void free_alleles(VCF_LOCUS *plocus)
 {
@@ -504,17 +1825,17 @@ static void free_alleles(VCF_LOCUS *plocus)
 }
 // }}}
 
-// free_samples {{{
-static void free_samples(VCF_LOCUS *plocus)
+// free_genotypes {{{
+static void free_genotypes(VCF_LOCUS *plocus)
 {
-	VCF_SAMPLE *tmp;
-
-	while (plocus->samples != NULL)
-	{
-		tmp = plocus->samples->next;
-		free(plocus->samples);
-		plocus->samples = tmp;
-	}
+	free(plocus->gt.bits);
+	plocus->gt.bits = NULL;
+	free(plocus->gt.packed);
+	plocus->gt.packed = NULL;
+	free(plocus->gt.alt_words);
+	plocus->gt.alt_words = NULL;
+	free(plocus->sketch.bits);
+	plocus->sketch.bits = NULL;
 }
 // }}}
 
@@ -529,36 +1850,110 @@ static bool locus_is_in_window(const VCF_LOCUS *plocus, const VCF_WINDOW *pwindo
 // }}}
 
 // locus_is_valid {{{
-static bool locus_is_valid(const VCF_LOCUS *plocus)
+static bool locus_is_valid(const VCF_LOCUS *plocus, const VCF_WINDOW *pwindow)
+{
+	// loci before the first head cannot pair with any head
+	return (plocus->pos >= pwindow->start);
+}
+// }}}
+
+// fields_pass {{{
+static bool fields_pass(const VCF_LOCUS *plocus, const LOCUS_FILTERS *pfilters)
+{
+	const VCF_ALLELE *pallele;
+
+	if (pfilters->pass_only && !plocus->filter.pass)
+		return false;
+	if (pfilters->min_qual > 0 && plocus->qual < pfilters->min_qual)
+		return false;
+	if (pfilters->vt[0] != '\0')
+	{
+		for (pallele = plocus->alleles->next; pallele != NULL; pallele = pallele->next)
+			if (strcmp(pallele->vt, pfilters->vt) == 0)
+				break;
+		if (pallele == NULL)
+			return false;
+	}
+
+	return true;
+}
+// }}}
+
+// counts_pass {{{
+
+/* The minor allele counts are those of the haplotypes not carrying the
+ * major allele, which also suits multiallelic loci. */
+static bool counts_pass(const VCF_LOCUS *plocus, const LOCUS_FILTERS *pfilters)
 {
-	return (plocus->pos >= 0);
+	const VCF_ALLELE *pallele;
+	int max_ac = 0;
+	unsigned long mac;
+
+	for (pallele = plocus->alleles; pallele != NULL; pallele = pallele->next)
+		if (pallele->ac > max_ac)
+			max_ac = pallele->ac;
+	mac = plocus->info.an - max_ac;
+
+	if (mac < pfilters->min_mac)
+		return false;
+	if (pfilters->min_maf > 0 && (plocus->info.an == 0
+				|| (double) mac / plocus->info.an < pfilters->min_maf))
+		return false;
+	if (pfilters->max_missing < 1 && (plocus->gt.nhaps == 0
+				|| 1 - (double) plocus->info.an / plocus->gt.nhaps > pfilters->max_missing))
+		return false;
+
+	return true;
+}
+// }}}
+
+// name_is_listed {{{
+static bool name_is_listed(const char *name, char **names, size_t nnames)
+{
+	return bsearch(&name, names, nnames, sizeof(char *), compare_names) != NULL;
+}
+// }}}
+
+// compare_names {{{
+static int compare_names(const void *pname1, const void *pname2)
+{
+	return strcmp(*(char * const *) pname1, *(char * const *) pname2);
 }
 // }}}
 
 // foreach_subfield {{{
-static void foreach_subfield(void (*fn)(char *subfield, VCF_LOCUS *plocus), const char *field, char sep, VCF_LOCUS *plocus)
+static int foreach_subfield(int (*fn)(char *subfield, VCF_LOCUS *plocus), const char *field, char sep, VCF_LOCUS *plocus)
 {
 	char *subfield, *find;
+	int status;
 
 	while ((find = strchr(field, sep)) != NULL)
 	{
 		subfield = (char *) malloc(sizeof(char) * (find - field + 1));
+		if (subfield == NULL)
+			return VCF_ENOMEM;
 		strncpy(subfield, field, find - field + 1);
 		subfield[find-field] = '\0';
-		(*fn)(subfield, plocus);
+		status = (*fn)(subfield, plocus);
 		field = find + 1;
 		free(subfield);
+		if (status != VCF_OK)
+			return status;
 	}
 	subfield = (char *) malloc(sizeof(char) * (strlen(field) + 1));
+	if (subfield == NULL)
+		return VCF_ENOMEM;
 	strncpy(subfield, field, strlen(field) + 1);
 	subfield[strlen(field)] = '\0';
-	(*fn)(subfield, plocus);
+	status = (*fn)(subfield, plocus);
 	free(subfield);
+
+	return status;
 }
 // }}}
 
 // parse_ac {{{
-static void parse_ac(char *subfield, VCF_LOCUS *plocus)
+static int parse_ac(char *subfield, VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *tmp;
 
@@ -567,7 +1962,7 @@ static void parse_ac(char *subfield, VCF_LOCUS *plocus)
 
 	//printf("expecting alt info: %d.\n", tmp->allele_info.ac);
 
-	while (tmp->ac >= 0) 
+	while (tmp != NULL && tmp->ac >= 0)
 	{
 	//printf("expecting alt info: %d.\n", tmp->allele_info.ac);
 	//printf("expecting next alt info: %d.\n",
@@ -576,44 +1971,56 @@ static void parse_ac(char *subfield, VCF_LOCUS *plocus)
 		tmp = tmp->next;
 	}
 	//printf("expercing tmp seq: %s.\n", tmp->allele_seq);
+	if (tmp == NULL)
+		return VCF_EMALFORMED; // more counts than alt alleles
 	tmp->ac = atoi(subfield);
+
+	return VCF_OK;
 }
 // }}}
 
 // parse_af {{{
-static void parse_af(char *subfield, VCF_LOCUS *plocus)
+static int parse_af(char *subfield, VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *tmp;
 
 	//printf("AF subdfield: %s.\n", subfield);
 	tmp = plocus->alleles->next; // start from the first alt allele
+	if (tmp == NULL)
+		return VCF_EMALFORMED;
 	while (tmp->next != NULL && tmp->af >= 0)
 		tmp = tmp->next;
 	tmp->af = atof(subfield);
+
+	return VCF_OK;
 }
 // }}}
 
 // parse_vt {{{
-static void parse_vt(char *subfield, VCF_LOCUS *plocus)
+static int parse_vt(char *subfield, VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *tmp;
 
 	tmp = plocus->alleles->next; // start from the first alt allele
+	if (tmp == NULL)
+		return VCF_EMALFORMED;
 	while (tmp->next != NULL && tmp->vt[0] != '\0') // stop at the first non-initialized member
 		tmp = tmp->next;
-	strcpy(tmp->vt, subfield);
+	strncpy(tmp->vt, subfield, MAXVTLEN - 1);
+	tmp->vt[MAXVTLEN - 1] = '\0';
+
+	return VCF_OK;
 }
 // }}}
 
 // parse_alt_seq {{{
-static void parse_alt_seq(char *subfield, VCF_LOCUS *plocus)
+static int parse_alt_seq(char *subfield, VCF_LOCUS *plocus)
 {
 	VCF_ALLELE *newallele, *tmp;
 
 	newallele = make_allele(subfield, plocus->info._an++);
-	// XXX handle this error
 	if (newallele == NULL)
-		exit(EXIT_FAILURE);
+		return VCF_ENOMEM;
 
 	tmp = plocus->alleles;
 	//printf("first allele of locus %d: %p\n",plocus->pos, tmp);
@@ -625,11 +2032,13 @@ static void parse_alt_seq(char *subfield, VCF_LOCUS *plocus)
 	//printf("last allele of locus %d: %p\n", plocus->pos, tmp);
 	tmp->next = newallele;
 	//printf("new last allele %p\n", tmp->next);
+
+	return VCF_OK;
 }
 // }}}
 
 // parse_info {{{
-static void parse_info(char *subfield, VCF_LOCUS *plocus)
+static int parse_info(char *subfield, VCF_LOCUS *plocus)
 {
 	char *datum;
 
@@ -648,18 +2057,20 @@ static void parse_info(char *subfield, VCF_LOCUS *plocus)
 	else if (strncmp(subfield, "AC=", 3) == 0)
 	{
 		datum = strchr(subfield, '=') + 1;
-		foreach_subfield(parse_ac, datum, ',', plocus);
+		return foreach_subfield(parse_ac, datum, ',', plocus);
 	}
 	else if (strncmp(subfield, "AF=", 3) == 0)
 	{
 		datum = strchr(subfield, '=') + 1;
-		foreach_subfield(parse_af, datum, ',', plocus);
+		return foreach_subfield(parse_af, datum, ',', plocus);
 	}
 	else if (strncmp(subfield, "VT=", 3) == 0)
 	{
 		datum = strchr(subfield, '=') + 1;
-		foreach_subfield(parse_vt, datum, ',', plocus);
+		return foreach_subfield(parse_vt, datum, ',', plocus);
 	}
+
+	return VCF_OK;
 }
 // }}}
 
@@ -10,20 +10,35 @@
 #ifndef _LD_VCF_H_
 #define _LD_VCF_H_
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
-#define MAXVTLEN 5 // enough to accomodate `INDEL'.
+#define MAXVTLEN 16 // room for the types like `INDEL' and the terminating null.
 #define MAXIDLEN 100
 #define SEQLEN 150 // max length of allele seq
 #define FILTLEN 50 // in our case we can only have PASS
 #define GTLEN 3 // max length of genotype
-#define INFOLEN 200
+#define NFIXED 8 // fields before FORMAT, from CHROM to INFO
 
+/* Status codes returned by the window operations. Nothing in this module
+ * prints or exits on its own: the caller decides what an error means. */
+enum vcf_status {
+	VCF_FILTERED = -2, // the line was left out by the filters (internal)
+	VCF_EOF = -1, // no more lines in the vcf file
+	VCF_OK = 0,
+	VCF_ENOMEM, // we ran out of memory
+	VCF_EMALFORMED, // a line of the vcf could not be parsed
+	VCF_ENODATA, // the vcf file has no data lines
+	VCF_EIO, // a file could not be read or written
+	VCF_ESHARD // shards are missing, repeated, overlapping or from different plans
+};
 
 typedef struct vcf_allele {
 	char allele_seq[SEQLEN]; // allocate space with malloc
 	int allele_num; // number assigned to the allele (found in the genotype field)
 	int ac; // number of ref/alt alleles in called genotypes
-	float af; // ref/alt allele frequency in the range (0,1)
+	double af; // ref/alt allele frequency in the range (0,1)
 	char vt[MAXVTLEN]; // what type of variant the line represents; for ref alleles this is always `REF'.
 	struct vcf_allele *next;
 } VCF_ALLELE;
@@ -40,34 +55,103 @@ typedef struct vcf_info {
 	unsigned int _an; // number of different alleles (1 ref + N alt) (*)
 } VCF_INFO;
 
-typedef struct vcf_format_gt {
-	int m; // maternal allele
-	int p; // paternal allele
-} VCF_FORMAT_GT;
-
-/* XXX The user shoud build this structure with as many fields as the format
- * field in the vcf, or she can limit to the relevant ones. Also, here we
- * consider diploid organisms, but this can be edited as well. We also add a
- * member for the phasing of the sample.
+/* The genotypes of a locus are packed as one bit set per allele: bit h of
+ * allele a is set when haplotype h carries a, haplotypes 2s and 2s+1 being
+ * the maternal and paternal alleles of sample s. A missing allele has no bit
+ * set. Here we consider diploid organisms, but this can be edited as well.
+ * When the window exceeds its memory budget, the bit sets of older loci are
+ * traded for a compressed encoding, which is expanded again on demand.
  */
-typedef struct vcf_sample {
-	VCF_FORMAT_GT gt;
-	bool phased; // whether this sample is phased or not (*)
-	struct vcf_sample *next;
-} VCF_SAMPLE;
+typedef struct vcf_genotypes {
+	unsigned long nhaps; // number of haplotypes (two per sample)
+	size_t nwords; // 64-bit words in the bit set of each allele
+	uint64_t *bits; // _an bit sets of nwords words; NULL if compressed
+	unsigned char *packed; // compressed encoding; NULL if expanded
+	size_t packed_len; // length of the compressed encoding
+	bool incompressible; // the encoding would not be smaller than the bits
+	bool rare; // the last allele is in few words, listed in alt_words
+	uint32_t *alt_words; // words where the last allele is carried, if rare
+	size_t nalt_words; // length of alt_words
+} VCF_GENOTYPES;
 
 typedef struct vcf_locus {
+	unsigned long seq; // order in which the locus entered the window, from 0
 	int chrom; // what about X and Y? -1 and -2? 23 and 24? enum??
 	unsigned long pos;
 	char id[MAXIDLEN]; // the complete ID field.
 	VCF_ALLELE *alleles; // the first allele in this linked list is the ref.
-	int qual;
+	double qual; // -1 if missing (`.')
 	VCF_FILTER filter;
 	VCF_INFO info;
-	VCF_SAMPLE *samples;
+	VCF_GENOTYPES gt;
+	VCF_GENOTYPES sketch; // genotypes of a subsample of the haplotypes
 	struct vcf_locus *next;
 } VCF_LOCUS;
 
+/* Which loci and samples enter the window. The filters on the fields of a
+ * line are checked before its samples are decoded, those on the counts
+ * right after; the samples left out take no bits in the genotypes. */
+typedef struct locus_filters {
+	bool pass_only; // only loci whose FILTER is PASS
+	double min_qual; // lowest QUAL; if > 0, a missing QUAL fails
+	double min_maf; // lowest frequency of the haplotypes not carrying the major allele
+	unsigned long min_mac; // lowest count of those haplotypes
+	double max_missing; // highest fraction of haplotypes not called
+	char vt[MAXVTLEN]; // type (VT) of some alt allele, any if empty
+	char **include; // names of the samples to keep, all if NULL
+	size_t ninclude;
+	char **exclude; // names of the samples to leave out
+	size_t nexclude;
+} LOCUS_FILTERS;
+
+/* How much the window had to give up to stay within its memory budget. */
+enum vcf_memory_level {
+	VCF_MEM_EXPANDED = 0, // all the loci are expanded
+	VCF_MEM_COMPRESSED, // some loci are compressed
+	VCF_MEM_OVER_BUDGET // even compressed, the loci exceed the budget
+};
+
+/* A pair of alleles at two loci with the linkage measures computed for
+ * them. The locus pointers are only valid inside the sink that receives
+ * the pair, and the genotypes of plocus2 may be compressed. */
+typedef struct ld_pair {
+	const VCF_LOCUS *plocus1;
+	int alnum1;
+	const VCF_LOCUS *plocus2;
+	int alnum2;
+	double p_A;
+	double p_B;
+	double p_AB;
+	double D;
+	double D_lewontin; // a.k.a. D'
+	double r_squared;
+	uint64_t n; // haplotypes the frequencies are over
+	bool estimated; // computed from the sketches of the loci
+} LD_PAIR;
+
+/* Haplotype counts for a pair of biallelic loci. Only the haplotypes called
+ * at both loci are counted, so that loci with different samples or missing
+ * genotypes can be paired. */
+typedef struct ld_counts {
+	uint64_t n; // haplotypes called at both loci
+	uint64_t c_A[2]; // carrying each allele of the first locus
+	uint64_t c_B[2]; // carrying each allele of the second locus
+	uint64_t c_AB[2][2]; // carrying both alleles
+	bool sketched; // counted on the sketches rather than on all haplotypes
+} LD_COUNTS;
+
+/* A result sink receives, for each head locus of the window, the batch of
+ * pairs between it and the other loci in the window (the batch may be
+ * empty, e.g. for multiallelic heads). phead is the head of the window, so
+ * following next from it visits all the loci in the window. Returning
+ * non-zero stops the scan and the value is handed back to the caller of
+ * Run_window(). */
+typedef int (*LD_SINK)(const VCF_LOCUS *phead, const LD_PAIR *pairs,
+					   size_t npairs, void *sink_data);
+
+/* The window is the context handle: it owns the one-locus parse buffer and
+ * the batch of pairs, so that several windows can be scanned at once, e.g.
+ * one per chromosome or per thread, as long as each has its own file. */
 typedef struct vcf_window {
 	VCF_LOCUS *head;
 	VCF_LOCUS *tail;
@@ -75,27 +159,152 @@ typedef struct vcf_window {
 	int winlen; // length of the sliding window
 	FILE *vcf_file; // file associated to the window
 	bool eow; // End Of Window
+	VCF_LOCUS buflocus; // next locus read from the file, not yet enqueued
+	LD_PAIR *pairs; // batch handed to the sink
+	size_t maxpairs; // allocated length of pairs
+	size_t memory; // bytes held by the loci in the queue
+	size_t max_memory; // budget for memory, 0 if unlimited
+	enum vcf_memory_level mem_level;
+	unsigned long ncompressed; // number of compressed loci in the queue
+	VCF_LOCUS *pcompress; // next candidate for compression, if known
+	uint64_t *scratch; // genotypes expanded on demand
+	size_t maxscratch; // allocated words of scratch
+	const VCF_LOCUS **partners; // loci paired with the head
+	LD_COUNTS *counts; // counts of each partner with the head
+	size_t *batches; // partners sorted by the kernel which counts them
+	size_t maxpartners; // allocated length of partners, counts and batches
+	unsigned long *sketch_haps; // haplotypes in the sketches, ascending
+	unsigned long sketch_len; // length of sketch_haps, 0 if exact
+	double sketch_verify; // pairs estimated above this r^2 are recounted
+	unsigned long start; // first position of a head locus
+	unsigned long end; // last position of a head locus
+	unsigned long nenqueued; // loci that entered the window so far
+	bool all_alleles; // pair all the alleles, not just the last ones
+	char *line; // line read from the file, if parsed here
+	size_t maxline; // allocated length of line
+	char *firstline; // the buffered first line as read, until the buffer moves on
+	int nthreads; // threads parsing the file
+	struct vcf_reader *preader; // the threads, once started
+	long bufoffset; // offset of the line in the buffer, before the scan
+	LOCUS_FILTERS filters;
+	char *header; // the names of the samples, each ended by '\0'
+	char **samples; // name of each sample column
+	unsigned long nsamples;
+	unsigned long *kept_before; // samples kept before each column, NULL if all
 } VCF_WINDOW;
 
 
-/* operation:		reads from the vcf file all the loci that fall within
- * 					<winlen> bases from the first locus.
+/* operation:		opens a window over a vcf file.
  * precondition:	vcf_file is fopen'd, a pointer to window is defined;
  * 					winlen is the length of the window.
- * postcondition:	adds the first loci to the queue and initializes it. */
-void Initialize_window(VCF_WINDOW *pwindow, FILE *vcf_file, int winlen);
+ * postcondition:	skips the header and reads the first locus into the
+ * 					buffer; the queue is filled by Fill_window() or
+ * 					Run_window(). Returns VCF_OK or an error code. */
+int Initialize_window(VCF_WINDOW *pwindow, FILE *vcf_file, int winlen);
+
+/* operation:		sets a budget for the memory used by the loci in the
+ * 					window.
+ * precondition:	pwindow is initialized; max_memory is in bytes, 0
+ * 					meaning no limit.
+ * postcondition:	when the budget is exceeded, the oldest loci but the
+ * 					first are compressed and mem_level reports it. */
+void Limit_window_memory(VCF_WINDOW *pwindow, size_t max_memory);
 
 /* operation:		moves the window forward one locus.
  * precondition:	pwindow is initialized.
  * postcondition:	removes the first locus from the queue; if appropriate
- * 					adds more locus from the file to the queue. */
-void Slide_window(VCF_WINDOW *pwindow);
+ * 					adds more locus from the file to the queue; returns
+ * 					VCF_OK or an error code. */
+int Slide_window(VCF_WINDOW *pwindow);
+
+/* operation:		makes the window estimate the linkage from sketches
+ * 					instead of counting all the haplotypes. The sketch
+ * 					of a locus, built when it enters the window, holds
+ * 					the same random subsample of nhaps haplotypes for
+ * 					every locus; r^2 is estimated on it and corrected for
+ * 					the bias of small samples, r^2 - (1 - r^2)/(n - 2),
+ * 					with a standard error of about 2r(1 - r^2)/sqrt(n),
+ * 					at most 0.77/sqrt(n): 0.0085 for the 8192 haplotypes
+ * 					of the default sketch. A pair costs O(nhaps) instead
+ * 					of O(haplotypes).
+ * precondition:	pwindow is initialized and still empty; nhaps > 2;
+ * 					pairs whose estimated r^2 reaches verify_r2 are
+ * 					counted again exactly (pass a value above 1 to never
+ * 					do so); seed picks the subsample.
+ * postcondition:	returns VCF_OK or VCF_ENOMEM. */
+int Sketch_window(VCF_WINDOW *pwindow, unsigned long nhaps, double verify_r2,
+				  unsigned long seed);
+
+/* operation:		restricts the head loci to the positions between start
+ * 					and end, both included, e.g. to run a shard.
+ * precondition:	pwindow is initialized and still empty; if offset is
+ * 					not negative, it is where the first locus to read
+ * 					starts in the file.
+ * postcondition:	loci before start are skipped and the file is read
+ * 					only <winlen> bases past end; returns VCF_OK or an
+ * 					error code. */
+int Restrict_window(VCF_WINDOW *pwindow, unsigned long start,
+					unsigned long end, long offset);
+
+/* operation:		chooses which pairs of alleles the sink receives.
+ * precondition:	pwindow is initialized.
+ * postcondition:	if all_alleles, all the combinations of the alleles
+ * 					of two loci are paired; otherwise (the default) only
+ * 					their last alleles, the alt-alt pair for biallelic
+ * 					loci, whose D' carries the sign of the linkage. */
+void Pair_all_alleles(VCF_WINDOW *pwindow, bool all_alleles);
+
+/* operation:		sets the loci and samples that enter the window.
+ * precondition:	pwindow is initialized and not yet scanned, nor
+ * 					restricted to a shard; the lists of samples in
+ * 					pfilters need not outlive the call.
+ * postcondition:	checks the buffered locus against the filters, and
+ * 					parses it again if samples are left out, without
+ * 					seeking in the file; listed names not in the header
+ * 					are ignored. Returns VCF_OK or an error code. */
+int Filter_window(VCF_WINDOW *pwindow, const LOCUS_FILTERS *pfilters);
+
+/* operation:		parses the file with several threads.
+ * precondition:	pwindow is initialized; nthreads is the number of
+ * 					threads, 1 or less meaning none.
+ * postcondition:	the threads start parsing ahead of the window at the
+ * 					next locus read and hand the loci over in file order.
+ * 					Restrict_window() stops them, they start again from
+ * 					the new offset. */
+void Parse_window_threads(VCF_WINDOW *pwindow, int nthreads);
+
+/* operation:		slides the window until it holds at least two loci.
+ * precondition:	pwindow is initialized.
+ * postcondition:	the window has two loci or more, or the file is
+ * 					exhausted; returns VCF_OK or an error code. */
+int Fill_window(VCF_WINDOW *pwindow);
+
+/* operation:		computes the linkage between the first locus of the
+ * 					window and all the others. The samples are scanned in
+ * 					tiles that fit in the cache, each tile of the head
+ * 					being paired with the same tile of every partner.
+ * precondition:	pwindow is initialized and not empty.
+ * postcondition:	the pairs are passed to sink in one batch; returns
+ * 					VCF_OK, VCF_ENOMEM or the non-zero value of sink. */
+int Compute_head_ld(VCF_WINDOW *pwindow, LD_SINK sink, void *sink_data);
+
+/* operation:		scans the whole file, computing the linkage of each
+ * 					locus with the following ones in the window.
+ * precondition:	pwindow is initialized.
+ * postcondition:	every head locus has been passed to sink; returns
+ * 					VCF_OK, an error code or the non-zero value of sink. */
+int Run_window(VCF_WINDOW *pwindow, LD_SINK sink, void *sink_data);
 
 /* operation:		removes all the loci from the window.
  * precondition:	pwindow is initialized.
  * postcondition:	all memory is freed. */
 void Close_window(VCF_WINDOW *pwindow);
 
+/* operation:		describes a status code.
+ * precondition:	status is one of enum vcf_status.
+ * postcondition:	returns a static string. */
+const char *Vcf_strerror(int status);
+
 /* operation:		gets number of loci currently in the window.
  * precondition:	pwindow points to an initialized window.
  * poscondition:	returns nloci. */
@@ -130,8 +339,9 @@ unsigned int Nalleles_in_locus(const VCF_LOCUS *plocus);
 
 /* operation:		calculates the frequency of an allele.
  * precondition:	pwindow points to an initialized window.
- * poscondition:	returns the frequency of the allele. */
-float Allele_freq(int alnum, const VCF_LOCUS *plocus);
+ * poscondition:	returns the frequency of the allele among the called
+ * 					haplotypes of the locus. */
+double Allele_freq(int alnum, const VCF_LOCUS *plocus);
 
 // XXX this would be a great occasion to write a variable-argument-number
 // function, if we knew how to calculate LD for more than two alleles!
@@ -139,15 +349,22 @@ float Allele_freq(int alnum, const VCF_LOCUS *plocus);
 /* operation:		calculates the frequency (p) of a pair of alleles at
  * 					different loci occurring together.
  * precondition:	alnum1 and alnum2 are two alleles of locus1 and locus2,
- * 					respectively.
- * postcondition:	returns the frequency of such event. */
-float Linked_alleles_freq(int alnum1, const VCF_LOCUS *plocus1,
-						  int alnum2, const VCF_LOCUS *plocus2);
+ * 					respectively; both loci are expanded.
+ * postcondition:	returns the frequency of such event among the
+ * 					haplotypes called at both loci. */
+double Linked_alleles_freq(int alnum1, const VCF_LOCUS *plocus1,
+						   int alnum2, const VCF_LOCUS *plocus2);
+
+/* operation:		counts the haplotypes of two biallelic loci.
+ * precondition:	both loci are expanded and have at most two alleles.
+ * postcondition:	fills pcounts. */
+void Count_linked_alleles(const VCF_LOCUS *plocus1, const VCF_LOCUS *plocus2,
+						  LD_COUNTS *pcounts);
 
-float Calculate_D(float p_A, float p_B, float p_AB);
+double Calculate_D(double p_A, double p_B, double p_AB);
 
-float Calculate_D_lewontin(float p_A, float p_B, float p_AB);
+double Calculate_D_lewontin(double p_A, double p_B, double p_AB);
 
-float Calculate_r_squared(float p_A, float p_B, float p_AB);
+double Calculate_r_squared(double p_A, double p_B, double p_AB);
 
 #endif
@@ -1,74 +1,846 @@
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include "ld_blocks.h"
+#include "ld_matrix.h"
+#include "ld_score.h"
 #include "ld_vcf.h"
+#include "shard.h"
+#include "../includes/type_utils.h"
 
-#define R2_CUTOFF 0 // value under which we shall not print anything
-#define WINLEN 10000 // length of the window, in bases.
+#define R2_CUTOFF 0 // value under which we shall not print anything, if not given
+#define WINLEN 10000 // length of the window, in bases, if not given
+#define SKETCH_LEN 8192 // haplotypes in a sketch, if not given
+#define SKETCH_SEED 42 // seed for the haplotypes of the sketches
+
+typedef struct print_data {
+	double r2_cutoff;
+	const VCF_WINDOW *pwindow;
+	enum vcf_memory_level reported; // last memory level we warned about
+	LD_MATRIX_WRITER *pmatrix; // if not NULL, the pairs go to the matrix
+	LD_SCORES *pscores; // if not NULL, the pairs go to the LD scores
+	LD_BLOCKS *pblocks; // if not NULL, the pairs go to the blocks
+} PRINT_DATA;
+
+static int print_pairs(const VCF_LOCUS *phead, const LD_PAIR *pairs,
+					   size_t npairs, void *sink_data);
+static void report_memory(PRINT_DATA *pdata);
+static bool parse_size(const char *arg, size_t *psize);
+static int read_names(const char *path, char ***pnames, size_t *pnnames);
+static void free_names(char **names, size_t nnames);
+static int parse_bins(const char *arg, double *bounds);
+static int read_plan(const char *plan_path, const char *id, SHARD *pshard);
+static int run_main(int argc, char *argv[]);
+static int plan_main(int argc, char *argv[]);
+static int merge_main(int argc, char *argv[]);
+static int query_main(int argc, char *argv[]);
+static int query_region(const LD_MATRIX *pmatrix, const char *region);
+static int query_variants(const LD_MATRIX *pmatrix, const char *list_path);
+static void print_entry(const LD_MATRIX *pmatrix, uint64_t i, const LDM_ENTRY *pentry);
+static void usage(const char *prog);
 
 int main(int argc, char *argv[])
 {
-	// TODO soft-code this parameters, maybe through command-line
-	// options
-	const int winlen = WINLEN;
-	const float r2_cutoff = R2_CUTOFF;
+	if (argc > 1 && strcmp(argv[1], "plan") == 0)
+		return plan_main(argc - 1, argv + 1);
+	else if (argc > 1 && strcmp(argv[1], "merge") == 0)
+		return merge_main(argc - 1, argv + 1);
+	else if (argc > 1 && strcmp(argv[1], "query") == 0)
+		return query_main(argc - 1, argv + 1);
+	else
+		return run_main(argc, argv);
+}
 
+// run_main {{{
+static int run_main(int argc, char *argv[])
+{
+	long winlen = WINLEN;
+	double r2_cutoff = R2_CUTOFF;
+	size_t max_memory = 0;
+	unsigned long sketch_len = 0;
+	double sketch_verify = 2; // never recount
+	const char *plan_path = NULL, *shard_id = NULL;
+	const char *matrix_path = NULL;
+	bool all_alleles = false, ld_score = false, blocks = false;
+	const char *annot_path = NULL;
+	double maf_bounds[MAXMAFBINS - 1];
+	int nbounds = 0, nthreads = 1;
+	FILE *matrix_file = NULL, *annot_file;
+	LOCUS_FILTERS filters = {.max_missing = 1};
+	const char *include_path = NULL, *exclude_path = NULL;
+	LD_MATRIX_WRITER matrix;
+	LD_SCORES scores;
+	LD_BLOCKS block_finder;
+	SHARD shard;
+	char *endptr;
+
+	static const struct option long_options[] = {
+		{"winlen", required_argument, NULL, 'W'},
+		{"r2-cutoff", required_argument, NULL, 'r'},
+		{"max-memory", required_argument, NULL, 'm'},
+		{"sketch", optional_argument, NULL, 's'},
+		{"sketch-verify", required_argument, NULL, 'v'},
+		{"plan", required_argument, NULL, 'p'},
+		{"shard", required_argument, NULL, 'k'},
+		{"matrix", required_argument, NULL, 'o'},
+		{"all-alleles", no_argument, NULL, 'a'},
+		{"ld-score", no_argument, NULL, 'l'},
+		{"ld-score-maf", required_argument, NULL, 'b'},
+		{"annot", required_argument, NULL, 'w'},
+		{"blocks", no_argument, NULL, 'g'},
+		{"threads", required_argument, NULL, 't'},
+		{"pass", no_argument, NULL, 'P'},
+		{"min-qual", required_argument, NULL, 'q'},
+		{"maf", required_argument, NULL, 'f'},
+		{"mac", required_argument, NULL, 'c'},
+		{"max-missing", required_argument, NULL, 'x'},
+		{"vt", required_argument, NULL, 'T'},
+		{"samples", required_argument, NULL, 'i'},
+		{"exclude-samples", required_argument, NULL, 'e'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
 	FILE *vcf_file;
 	VCF_WINDOW window;
-	VCF_LOCUS *plocus1, *plocus2;
-	float p_AB, p_A, p_B;
-	float D, D_lewontin, r_squared;
+	PRINT_DATA print_data;
+	int opt, status;
 
-	if (argc != 2)
+	while ((opt = getopt_long(argc, argv, "W:r:m:s::v:p:k:o:alb:w:gt:Pq:f:c:x:T:i:e:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'W':
+				winlen = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || winlen <= 0 || winlen > INT_MAX)
+				{
+					fprintf(stderr, "ERROR: invalid window length: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'r':
+				r2_cutoff = strtod(optarg, &endptr);
+				if (*endptr != '\0' || r2_cutoff < 0 || r2_cutoff > 1)
+				{
+					fprintf(stderr, "ERROR: invalid r^2 cutoff: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'm':
+				if (!parse_size(optarg, &max_memory))
+				{
+					fprintf(stderr, "ERROR: invalid memory size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				sketch_len = (optarg == NULL) ? SKETCH_LEN : strtoul(optarg, &endptr, 10);
+				if (optarg != NULL && (*endptr != '\0' || sketch_len <= 2))
+				{
+					fprintf(stderr, "ERROR: invalid sketch size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'v':
+				sketch_verify = strtod(optarg, &endptr);
+				if (*endptr != '\0')
+				{
+					fprintf(stderr, "ERROR: invalid r^2: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				plan_path = optarg;
+				break;
+			case 'k':
+				shard_id = optarg;
+				break;
+			case 'o':
+				matrix_path = optarg;
+				break;
+			case 'a':
+				all_alleles = true;
+				break;
+			case 'l':
+				ld_score = true;
+				break;
+			case 'b':
+				if ((nbounds = parse_bins(optarg, maf_bounds)) < 0)
+				{
+					fprintf(stderr, "ERROR: invalid MAF bins: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				ld_score = true;
+				break;
+			case 'w':
+				annot_path = optarg;
+				ld_score = true;
+				break;
+			case 'g':
+				blocks = true;
+				break;
+			case 't':
+				nthreads = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || nthreads < 1)
+				{
+					fprintf(stderr, "ERROR: invalid number of threads: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'P':
+				filters.pass_only = true;
+				break;
+			case 'q':
+				filters.min_qual = strtod(optarg, &endptr);
+				if (*endptr != '\0' || filters.min_qual < 0)
+				{
+					fprintf(stderr, "ERROR: invalid QUAL: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':
+				filters.min_maf = strtod(optarg, &endptr);
+				if (*endptr != '\0' || filters.min_maf < 0 || filters.min_maf > 0.5)
+				{
+					fprintf(stderr, "ERROR: invalid MAF: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'c':
+				filters.min_mac = strtoul(optarg, &endptr, 10);
+				if (*endptr != '\0')
+				{
+					fprintf(stderr, "ERROR: invalid MAC: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'x':
+				filters.max_missing = strtod(optarg, &endptr);
+				if (*endptr != '\0' || filters.max_missing < 0 || filters.max_missing > 1)
+				{
+					fprintf(stderr, "ERROR: invalid fraction of missing haplotypes: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'T':
+				if (strlen(optarg) >= MAXVTLEN)
+				{
+					fprintf(stderr, "ERROR: invalid variant type: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				strcpy(filters.vt, optarg);
+				break;
+			case 'i':
+				include_path = optarg;
+				break;
+			case 'e':
+				exclude_path = optarg;
+				break;
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1 || (plan_path == NULL) != (shard_id == NULL))
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((ld_score || blocks) && (plan_path != NULL || matrix_path != NULL))
+	{
+		// a shard has no halo before its start, where the pairs of its
+		// first loci come from
+		fprintf(stderr, "ERROR: LD scores and blocks need the whole file, with no shard or matrix.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ld_score && blocks)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (plan_path != NULL && (status = read_plan(plan_path, shard_id, &shard)) != VCF_OK)
 	{
-		fprintf(stderr, "USAGE: %s <vcf_file>", argv[0]);
+		fprintf(stderr, "ERROR: could not find shard %s in %s: %s.\n",
+				shard_id, plan_path, Vcf_strerror(status));
 		exit(EXIT_FAILURE);
 	}
-	if ((vcf_file = fopen(argv[1], "r")) == NULL)
+	if (include_path != NULL && (status = read_names(include_path,
+					&filters.include, &filters.ninclude)) != VCF_OK)
 	{
-		fprintf(stderr, "ERROR: could not read VCF: %s", argv[1]);
+		fprintf(stderr, "ERROR: could not read samples %s: %s.\n",
+				include_path, Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+	if (exclude_path != NULL && (status = read_names(exclude_path,
+					&filters.exclude, &filters.nexclude)) != VCF_OK)
+	{
+		fprintf(stderr, "ERROR: could not read samples %s: %s.\n",
+				exclude_path, Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+	if ((vcf_file = fopen(argv[optind], "r")) == NULL)
+	{
+		fprintf(stderr, "ERROR: could not read VCF: %s\n", argv[optind]);
 		exit(EXIT_FAILURE);
 	}
 
-	// Ensure that at least two loci are present in the window.
-	Initialize_window(&window, vcf_file, winlen);
-	while (window.nloci < 2 && !window.eow)
-		Slide_window(&window);
+	print_data.r2_cutoff = r2_cutoff;
+	print_data.pwindow = &window;
+	print_data.reported = VCF_MEM_EXPANDED;
+	print_data.pmatrix = NULL;
+	print_data.pscores = NULL;
+	print_data.pblocks = NULL;
+	if (matrix_path != NULL)
+	{
+		if ((matrix_file = fopen(matrix_path, "wb")) == NULL)
+		{
+			fprintf(stderr, "ERROR: could not write matrix: %s\n", matrix_path);
+			exit(EXIT_FAILURE);
+		}
+		if ((status = Open_matrix_writer(&matrix, matrix_file, print_data.r2_cutoff)) != VCF_OK)
+		{
+			fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+			exit(EXIT_FAILURE);
+		}
+		print_data.pmatrix = &matrix;
+	}
+	if (ld_score)
+	{
+		if ((status = Open_ld_scores(&scores, stdout, maf_bounds, nbounds)) != VCF_OK)
+		{
+			fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+			exit(EXIT_FAILURE);
+		}
+		if (annot_path != NULL)
+		{
+			if ((annot_file = fopen(annot_path, "r")) == NULL)
+			{
+				fprintf(stderr, "ERROR: could not read annotation: %s\n", annot_path);
+				exit(EXIT_FAILURE);
+			}
+			status = Load_annotation(&scores, annot_file);
+			fclose(annot_file);
+			if (status != VCF_OK)
+			{
+				fprintf(stderr, "ERROR: could not load annotation %s: %s.\n",
+						annot_path, Vcf_strerror(status));
+				exit(EXIT_FAILURE);
+			}
+		}
+		print_data.pscores = &scores;
+	}
+	if (blocks)
+	{
+		Open_blocks(&block_finder, stdout, (int) winlen);
+		print_data.pblocks = &block_finder;
+	}
+
+	if ((status = Initialize_window(&window, vcf_file, (int) winlen)) == VCF_OK)
+	{
+		Limit_window_memory(&window, max_memory);
+		Pair_all_alleles(&window, all_alleles);
+		status = Filter_window(&window, &filters);
+		free_names(filters.include, filters.ninclude);
+		free_names(filters.exclude, filters.nexclude);
+		if (status == VCF_OK && plan_path != NULL)
+		{
+			// a matrix knows its own loci, it needs no header
+			if (matrix_path == NULL)
+				Write_shard_header(stdout, &shard);
+			status = Restrict_window(&window, shard.start, shard.end, shard.offset);
+		}
+		Parse_window_threads(&window, nthreads);
+		if (status == VCF_OK && sketch_len > 0)
+			status = Sketch_window(&window, sketch_len, sketch_verify, SKETCH_SEED);
+		if (status == VCF_OK)
+			status = Run_window(&window, print_pairs, &print_data);
+	}
+
+	Close_window(&window);
+	fclose(vcf_file);
+	if (matrix_path != NULL)
+	{
+		if (status == VCF_OK)
+			status = Close_matrix_writer(&matrix);
+		else
+			Close_matrix_writer(&matrix);
+		if (fclose(matrix_file) != 0 && status == VCF_OK)
+			status = VCF_EIO;
+	}
+	if (ld_score)
+		Close_ld_scores(&scores);
+	if (blocks)
+	{
+		if (status == VCF_OK)
+			status = Close_blocks(&block_finder);
+		else
+			Close_blocks(&block_finder);
+	}
 
-	while (window.nloci >= 2)
+	if (status != VCF_OK)
 	{
-		plocus2 = plocus1 = window.head;
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
+// }}}
 
-		// the loci must be biallelic in order for our formulae to work
-		if (Nalleles_in_locus(plocus1) <= 2)
-		while (plocus2 != window.tail)
+// plan_main {{{
+static int plan_main(int argc, char *argv[])
+{
+	FILE *vcf_file;
+	SHARD *shards;
+	int nshards = 0, nplanned, opt, status;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		if (opt != 'n' || (nshards = atoi(optarg)) <= 0)
 		{
-			plocus2 = plocus2->next;
+			fprintf(stderr, "USAGE: %s -n <nshards> <vcf_file>\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1 || nshards <= 0)
+	{
+		fprintf(stderr, "USAGE: %s -n <nshards> <vcf_file>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((vcf_file = fopen(argv[optind], "r")) == NULL)
+	{
+		fprintf(stderr, "ERROR: could not read VCF: %s\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if ((shards = (SHARD *) malloc(nshards * sizeof(SHARD))) == NULL)
+	{
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(VCF_ENOMEM));
+		exit(EXIT_FAILURE);
+	}
 
-			if (Nalleles_in_locus(plocus2) <= 2)
-			for (int i = 0; i < Nalleles_in_locus(plocus1); i++)
-				for (int j = 0; j < Nalleles_in_locus(plocus2); j++)
-				{
-					p_A = Allele_freq(i, plocus1);
-					p_B = Allele_freq(j, plocus2);
-					p_AB = Linked_alleles_freq(i, plocus1, j, plocus2);
-					D = Calculate_D(p_A, p_B, p_AB);
-					D_lewontin = Calculate_D_lewontin(p_A, p_B, p_AB); // a.k.a. D'
-					r_squared = Calculate_r_squared(p_A, p_B, p_AB);
-					if (r_squared >= r2_cutoff)
-						printf("%d\t%d\t%d\t%d\t%f\t%f\t%f\tD=%f\tD'=%f\tr^2=%f\n",
-								i, plocus1->pos, j, plocus2->pos, p_A, p_B, p_AB,
-								D, D_lewontin, r_squared);
-				}
+	if ((status = Plan_shards(vcf_file, nshards, shards, &nplanned)) == VCF_OK)
+		status = Write_plan(stdout, shards, nplanned);
+
+	free(shards);
+	fclose(vcf_file);
+
+	if (status != VCF_OK)
+	{
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+	if (nplanned < nshards)
+		fprintf(stderr, "WARNING: only %d shards, there are too few loci for %d.\n",
+				nplanned, nshards);
+
+	return 0;
+}
+// }}}
+
+// merge_main {{{
+static int merge_main(int argc, char *argv[])
+{
+	FILE **outs;
+	int nouts = argc - 1, status;
+
+	if (nouts < 1)
+	{
+		fprintf(stderr, "USAGE: %s <shard_output>...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((outs = (FILE **) malloc(nouts * sizeof(FILE *))) == NULL)
+	{
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(VCF_ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nouts; i++)
+		if ((outs[i] = fopen(argv[i+1], "r")) == NULL)
+		{
+			fprintf(stderr, "ERROR: could not read shard output: %s\n", argv[i+1]);
+			exit(EXIT_FAILURE);
 		}
 
-		Slide_window(&window);
-		// If we opened a window with less than two loci, we try again.
-		while (window.nloci < 2 && !window.eow)
-			Slide_window(&window);
+	status = Merge_shards(outs, nouts, stdout);
+
+	for (int i = 0; i < nouts; i++)
+		fclose(outs[i]);
+	free(outs);
+
+	if (status != VCF_OK)
+	{
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+		exit(EXIT_FAILURE);
 	}
 
-	Close_window(&window);
-	fclose(vcf_file);
+	return 0;
+}
+// }}}
+
+// query_main {{{
+static int query_main(int argc, char *argv[])
+{
+	const char *region = NULL, *list_path = NULL;
+	LD_MATRIX matrix;
+	int opt, status;
+
+	while ((opt = getopt(argc, argv, "r:l:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':
+				region = optarg;
+				break;
+			case 'l':
+				list_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1 || (region == NULL) == (list_path == NULL))
+	{
+		fprintf(stderr, "USAGE: %s (-r <start>-<end> | -l <variants>) <matrix>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((status = Open_matrix(&matrix, argv[optind])) != VCF_OK)
+	{
+		fprintf(stderr, "ERROR: could not open matrix %s: %s.\n",
+				argv[optind], Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+
+	if (region != NULL)
+		status = query_region(&matrix, region);
+	else
+		status = query_variants(&matrix, list_path);
+
+	Close_matrix(&matrix);
+
+	if (status != VCF_OK)
+	{
+		fprintf(stderr, "ERROR: %s.\n", Vcf_strerror(status));
+		exit(EXIT_FAILURE);
+	}
 
 	return 0;
 }
+// }}}
+
+// query_region {{{
+
+/* Prints the pairs of loci both between start and end: the rows of the
+ * region, each up to the first column past it. */
+static int query_region(const LD_MATRIX *pmatrix, const char *region)
+{
+	const uint64_t nloci = pmatrix->header->nloci;
+	unsigned long start, end;
+	uint64_t first, last;
+
+	if (sscanf(region, "%lu-%lu", &start, &end) != 2 || start > end)
+		return VCF_EMALFORMED;
+
+	first = Matrix_locus_at(pmatrix, start);
+	last = Matrix_locus_at(pmatrix, (uint64_t) end + 1);
+	for (uint64_t i = first; i < last && i < nloci; i++)
+		for (uint64_t k = pmatrix->rows[i]; k < pmatrix->rows[i+1]; k++)
+		{
+			if (pmatrix->entries[k].col >= last)
+				break;
+			print_entry(pmatrix, i, &pmatrix->entries[k]);
+		}
+
+	return VCF_OK;
+}
+// }}}
+
+// query_variants {{{
+
+/* Prints the pairs among the variants listed in a file, one per line, by
+ * position or by ID. */
+static int query_variants(const LD_MATRIX *pmatrix, const char *list_path)
+{
+	const uint64_t nloci = pmatrix->header->nloci;
+	FILE *list_file;
+	char variant[MAXIDLEN];
+	uint64_t *loci = NULL, *tmp, i;
+	size_t nlisted = 0, maxlisted = 0;
+	const LDM_ENTRY *pentry;
+	char *endptr;
+	unsigned long pos;
+
+	if ((list_file = fopen(list_path, "r")) == NULL)
+		return VCF_EIO;
+	while (fscanf(list_file, "%99s", variant) == 1)
+	{
+		pos = strtoul(variant, &endptr, 10);
+		if (*endptr == '\0')
+		{
+			i = Matrix_locus_at(pmatrix, pos);
+			if (i < nloci && pmatrix->loci[i].pos != pos)
+				i = nloci;
+		}
+		else
+			i = Matrix_locus_id(pmatrix, variant);
+		if (i == nloci)
+		{
+			fprintf(stderr, "WARNING: variant %s is not in the matrix.\n", variant);
+			continue;
+		}
+
+		if (nlisted == maxlisted)
+		{
+			maxlisted = (maxlisted == 0) ? 64 : 2 * maxlisted;
+			if ((tmp = (uint64_t *) realloc(loci, maxlisted * sizeof(uint64_t))) == NULL)
+			{
+				free(loci);
+				fclose(list_file);
+				return VCF_ENOMEM;
+			}
+			loci = tmp;
+		}
+		loci[nlisted++] = i;
+	}
+	fclose(list_file);
+
+	for (size_t a = 0; a < nlisted; a++)
+		for (size_t b = 0; b < nlisted; b++)
+			if (loci[a] < loci[b] && (pentry = Matrix_entry(pmatrix, loci[a], loci[b])) != NULL)
+				print_entry(pmatrix, loci[a], pentry);
+
+	free(loci);
+	return VCF_OK;
+}
+// }}}
+
+// print_entry {{{
+static void print_entry(const LD_MATRIX *pmatrix, uint64_t i, const LDM_ENTRY *pentry)
+{
+	const LDM_LOCUS *plocus1 = &pmatrix->loci[i];
+	const LDM_LOCUS *plocus2 = &pmatrix->loci[pentry->col];
+
+	printf("%lu\t%s\t%lu\t%s\tD'=%f\tr^2=%f\n",
+			(unsigned long) plocus1->pos, pmatrix->ids + plocus1->id,
+			(unsigned long) plocus2->pos, pmatrix->ids + plocus2->id,
+			(double) pentry->dprime / LDM_DPRIME_SCALE,
+			(double) pentry->r2 / LDM_R2_SCALE);
+}
+// }}}
+
+// read_plan {{{
+static int read_plan(const char *plan_path, const char *id, SHARD *pshard)
+{
+	FILE *plan_file;
+	char *endptr;
+	long k;
+	int status;
+
+	k = strtol(id, &endptr, 10);
+	if (*endptr != '\0' || k < 0)
+		return VCF_ESHARD;
+	if ((plan_file = fopen(plan_path, "r")) == NULL)
+		return VCF_EIO;
+	status = Read_shard(plan_file, (int) k, pshard);
+	fclose(plan_file);
+
+	return status;
+}
+// }}}
+
+// print_pairs {{{
+static int print_pairs(const VCF_LOCUS *phead, const LD_PAIR *pairs,
+					   size_t npairs, void *sink_data)
+{
+	PRINT_DATA *pdata = (PRINT_DATA *) sink_data;
+
+	report_memory(pdata);
+	if (pdata->pmatrix != NULL)
+		return Matrix_sink(phead, pairs, npairs, pdata->pmatrix);
+	if (pdata->pscores != NULL)
+		return Ld_score_sink(phead, pairs, npairs, pdata->pscores);
+	if (pdata->pblocks != NULL)
+		return Block_sink(phead, pairs, npairs, pdata->pblocks);
+	for (size_t k = 0; k < npairs; k++)
+		if (pairs[k].r_squared >= pdata->r2_cutoff)
+			printf("%d\t%lu\t%d\t%lu\t%f\t%f\t%f\tD=%f\tD'=%f\tr^2=%f\n",
+					pairs[k].alnum1, pairs[k].plocus1->pos,
+					pairs[k].alnum2, pairs[k].plocus2->pos,
+					pairs[k].p_A, pairs[k].p_B, pairs[k].p_AB,
+					pairs[k].D, pairs[k].D_lewontin, pairs[k].r_squared);
+
+	return 0;
+}
+// }}}
+
+// report_memory {{{
+
+/* Warns once each time the window degrades further to stay within its
+ * memory budget. */
+static void report_memory(PRINT_DATA *pdata)
+{
+	const VCF_WINDOW *pwindow = pdata->pwindow;
+
+	if (pwindow->mem_level <= pdata->reported)
+		return;
+
+	if (pwindow->mem_level == VCF_MEM_COMPRESSED)
+		fprintf(stderr, "WARNING: window exceeds %zu bytes, compressing "
+				"older loci (%d loci, %lu compressed).\n",
+				pwindow->max_memory, pwindow->nloci, pwindow->ncompressed);
+	else
+		fprintf(stderr, "WARNING: window exceeds %zu bytes even with "
+				"compressed loci (%d loci, %zu bytes).\n",
+				pwindow->max_memory, pwindow->nloci, pwindow->memory);
+	pdata->reported = pwindow->mem_level;
+}
+// }}}
+
+// parse_size {{{
+
+/* Reads a number of bytes, optionally followed by a K, M or G suffix. */
+static bool parse_size(const char *arg, size_t *psize)
+{
+	unsigned long size;
+	const char *suffix = arg;
+
+	if (!isdigit(*arg))
+		return false;
+	size = atoul((char *) arg);
+	while (isdigit(*suffix))
+		suffix++;
+
+	switch (toupper(*suffix))
+	{
+		case 'G':
+			size *= 1024;
+			// fall through
+		case 'M':
+			size *= 1024;
+			// fall through
+		case 'K':
+			size *= 1024;
+			suffix++;
+			break;
+	}
+	if (*suffix != '\0' && toupper(*suffix) != 'B')
+		return false;
+
+	*psize = size;
+	return true;
+}
+// }}}
+
+// read_names {{{
+
+/* Reads the names listed in a file, one per line. */
+static int read_names(const char *path, char ***pnames, size_t *pnnames)
+{
+	FILE *list_file;
+	char name[MAXIDLEN], **names = NULL, **tmp;
+	size_t nnames = 0, maxnames = 0;
+
+	if ((list_file = fopen(path, "r")) == NULL)
+		return VCF_EIO;
+	while (fscanf(list_file, "%99s", name) == 1)
+	{
+		if (nnames == maxnames)
+		{
+			maxnames = (maxnames == 0) ? 64 : 2 * maxnames;
+			if ((tmp = (char **) realloc(names, maxnames * sizeof(char *))) == NULL)
+				break;
+			names = tmp;
+		}
+		if ((names[nnames] = strdup(name)) == NULL)
+			break;
+		nnames++;
+	}
+	if (!feof(list_file))
+	{
+		free_names(names, nnames);
+		fclose(list_file);
+		return VCF_ENOMEM;
+	}
+	fclose(list_file);
+
+	// an empty list keeps no sample, rather than all of them
+	if (names == NULL && (names = (char **) malloc(sizeof(char *))) == NULL)
+		return VCF_ENOMEM;
+	*pnames = names;
+	*pnnames = nnames;
+	return VCF_OK;
+}
+// }}}
+
+// free_names {{{
+static void free_names(char **names, size_t nnames)
+{
+	for (size_t i = 0; i < nnames; i++)
+		free(names[i]);
+	free(names);
+}
+// }}}
+
+// parse_bins {{{
+
+/* Reads the ascending upper bounds of the MAF bins, separated by commas,
+ * into bounds, which has room for MAXMAFBINS - 1 of them;
+ * returns how many, or -1 if invalid. */
+static int parse_bins(const char *arg, double *bounds)
+{
+	int nbounds = 0;
+	char *endptr;
+
+	do
+	{
+		// room for the bounds of all the bins but the last
+		if (nbounds >= MAXMAFBINS - 1)
+			return -1;
+		bounds[nbounds] = strtod(arg, &endptr);
+		if (endptr == arg || bounds[nbounds] <= 0 || bounds[nbounds] > 0.5
+				|| (nbounds > 0 && bounds[nbounds] <= bounds[nbounds-1]))
+			return -1;
+		nbounds++;
+		arg = endptr + 1;
+	} while (*endptr == ',');
+
+	return (*endptr == '\0') ? nbounds : -1;
+}
+// }}}
+
+// usage {{{
+static void usage(const char *prog)
+{
+	fprintf(stderr, "USAGE: %s [options] <vcf_file>\n", prog);
+	fprintf(stderr, "       %s plan -n <nshards> <vcf_file> > <plan>\n", prog);
+	fprintf(stderr, "       %s merge <shard_output>...\n", prog);
+	fprintf(stderr, "       %s query (-r <start>-<end> | -l <variants>) <matrix>\n", prog);
+	fprintf(stderr, "  -W, --winlen N\tpair the loci at most N bases apart (default %d)\n", WINLEN);
+	fprintf(stderr, "  -r, --r2-cutoff R2\tleave out of the pairs and the matrix those with r^2 < R2 (default %d)\n", R2_CUTOFF);
+	fprintf(stderr, "  -m, --max-memory SIZE\tmemory budget for the loci in the window, e.g. 512M\n");
+	fprintf(stderr, "  -s, --sketch[=N]\testimate r^2 on a subsample of N haplotypes (default %d)\n", SKETCH_LEN);
+	fprintf(stderr, "  -v, --sketch-verify R2\tcount exactly the pairs estimated at r^2 >= R2\n");
+	fprintf(stderr, "  -p, --plan PLAN\tread the shards from PLAN, made by `plan'\n");
+	fprintf(stderr, "  -k, --shard K\t\tonly compute the pairs whose first locus is in shard K\n");
+	fprintf(stderr, "  -a, --all-alleles\tprint the four pairs of alleles of two loci, not just alt-alt\n");
+	fprintf(stderr, "  -o, --matrix FILE\twrite the alt-alt pairs as a sparse matrix to FILE\n");
+	fprintf(stderr, "  -l, --ld-score\t\tprint the LD score of each locus instead of the pairs\n");
+	fprintf(stderr, "  -b, --ld-score-maf B1,B2,...\tsplit the LD scores by the MAF of the partner\n");
+	fprintf(stderr, "  -w, --annot FILE\tweight the partners of the LD scores by a position-weight FILE\n");
+	fprintf(stderr, "  -g, --blocks\t\tprint the haplotype blocks (Gabriel et al.) instead of the pairs\n");
+	fprintf(stderr, "  -t, --threads N\tparse the VCF with N threads\n");
+	fprintf(stderr, "  -P, --pass\t\tonly read the loci whose FILTER is PASS\n");
+	fprintf(stderr, "  -q, --min-qual Q\tonly read the loci with QUAL >= Q, leaving out a missing QUAL\n");
+	fprintf(stderr, "  -f, --maf F\t\tonly read the loci whose minor alleles have frequency >= F\n");
+	fprintf(stderr, "  -c, --mac C\t\tonly read the loci whose minor alleles are called >= C times\n");
+	fprintf(stderr, "  -x, --max-missing F\tonly read the loci with a fraction <= F of missing haplotypes\n");
+	fprintf(stderr, "  -T, --vt TYPE\t\tonly read the loci with an alt allele of type TYPE, e.g. SNP\n");
+	fprintf(stderr, "  -i, --samples FILE\tonly read the samples listed in FILE\n");
+	fprintf(stderr, "  -e, --exclude-samples FILE\tleave out the samples listed in FILE\n");
+	fprintf(stderr, "  -h, --help\t\tprint this help\n");
+}
+// }}}
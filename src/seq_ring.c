@@ -0,0 +1,76 @@
+/* Interface implementation */
+
+#include <stdlib.h>
+#include <string.h>
+#include "seq_ring.h"
+
+
+// Open_ring {{{
+void Open_ring(SEQ_RING *pring, size_t size)
+{
+	memset(pring, 0, sizeof(SEQ_RING));
+	pring->size = size;
+}
+// }}}
+
+// Ring_push {{{
+
+/* A full ring doubles, unrolled: all the slots are copied from the oldest
+ * on, the unused ones too, for what they hold. */
+void *Ring_push(SEQ_RING *pring)
+{
+	unsigned char *tmp;
+	size_t maxslots;
+
+	if (pring->nslots == pring->maxslots)
+	{
+		maxslots = (pring->maxslots == 0) ? 64 : 2 * pring->maxslots;
+		if ((tmp = (unsigned char *) calloc(maxslots, pring->size)) == NULL)
+			return NULL;
+		for (size_t i = 0; i < pring->maxslots; i++)
+			memcpy(tmp + i * pring->size,
+				   Ring_slot(pring, (pring->first + i) % pring->maxslots),
+				   pring->size);
+		free(pring->slots);
+		pring->slots = tmp;
+		pring->maxslots = maxslots;
+		pring->first = 0;
+	}
+	pring->nslots++;
+
+	return Ring_at(pring, pring->first_seq + pring->nslots - 1);
+}
+// }}}
+
+// Ring_pop {{{
+void Ring_pop(SEQ_RING *pring)
+{
+	pring->first = (pring->first + 1) % pring->maxslots;
+	pring->first_seq++;
+	pring->nslots--;
+}
+// }}}
+
+// Ring_at {{{
+void *Ring_at(const SEQ_RING *pring, unsigned long seq)
+{
+	return Ring_slot(pring, (pring->first + (seq - pring->first_seq)) % pring->maxslots);
+}
+// }}}
+
+// Ring_slot {{{
+void *Ring_slot(const SEQ_RING *pring, size_t i)
+{
+	return pring->slots + i * pring->size;
+}
+// }}}
+
+// Close_ring {{{
+void Close_ring(SEQ_RING *pring)
+{
+	free(pring->slots);
+	pring->slots = NULL;
+	pring->maxslots = pring->nslots = 0;
+	pring->first = 0;
+}
+// }}}
@@ -0,0 +1,58 @@
+/* Interface definition
+ *
+ * A ring of records indexed by the seq of a locus, for the sinks which
+ * keep some state for each locus of the window.
+ *
+ * The records of consecutive seqs are added at the end and dropped from
+ * the start. A slot keeps what it held when it is used again, so that a
+ * record can hold on to the buffers it owns; a slot never used before is
+ * zeroed.
+ */
+
+#ifndef _SEQ_RING_H_
+#define _SEQ_RING_H_
+#include <stddef.h>
+
+typedef struct seq_ring {
+	unsigned char *slots; // maxslots records of size bytes
+	size_t size; // bytes of a record
+	size_t maxslots;
+	size_t first; // slot of the oldest record
+	size_t nslots; // records in the ring
+	unsigned long first_seq; // seq of the oldest record
+} SEQ_RING;
+
+/* operation:		starts an empty ring.
+ * precondition:	size is the size of a record.
+ * postcondition:	the ring holds no record and no memory. */
+void Open_ring(SEQ_RING *pring, size_t size);
+
+/* operation:		adds the record of seq first_seq + nslots.
+ * precondition:	pring is open.
+ * postcondition:	returns the record, as it was left in its slot,
+ * 					NULL if memory failure; the records move if the
+ * 					ring grows. */
+void *Ring_push(SEQ_RING *pring);
+
+/* operation:		drops the oldest record.
+ * precondition:	the ring is not empty.
+ * postcondition:	first_seq is the next seq. */
+void Ring_pop(SEQ_RING *pring);
+
+/* operation:		finds the record of a seq.
+ * precondition:	first_seq <= seq < first_seq + nslots.
+ * postcondition:	returns the record. */
+void *Ring_at(const SEQ_RING *pring, unsigned long seq);
+
+/* operation:		finds a slot, in use or not.
+ * precondition:	i < maxslots.
+ * postcondition:	returns the record in slot i, e.g. to free what it
+ * 					holds before Close_ring(). */
+void *Ring_slot(const SEQ_RING *pring, size_t i);
+
+/* operation:		frees the ring.
+ * precondition:	pring is open.
+ * postcondition:	the ring is empty and holds no memory. */
+void Close_ring(SEQ_RING *pring);
+
+#endif
@@ -0,0 +1,233 @@
+/* Interface implementation */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ld_vcf.h"
+#include "shard.h"
+#include "../includes/io_utils.h"
+
+#define HEADERLEN 200 // max length of a shard header
+#define PLAN_BASIS 14695981039346656037UL // FNV-1a offset basis
+
+static int next_position(FILE *vcf_file, unsigned long *ppos, long *poffset);
+static int parse_shard(const char *line, SHARD *pshard);
+static int compare_shards(const void *p1, const void *p2);
+static unsigned long hash_plan(unsigned long h, unsigned long value);
+
+
+// Plan_shards {{{
+
+/* Two passes over the file: the first counts the loci, the second cuts a
+ * shard every so many of them, at the first change of position. Only the
+ * position of each line is read, the rest is skipped. */
+int Plan_shards(FILE *vcf_file, int nshards, SHARD *shards, int *pnplanned)
+{
+	unsigned long nloci = 0, per_shard, inshard = 0;
+	unsigned long pos, lastpos = 0, plan;
+	long offset, size;
+	int status, n = 0;
+
+	while ((status = next_position(vcf_file, &pos, &offset)) == VCF_OK)
+		nloci++;
+	if (status != VCF_EOF)
+		return status;
+	if (nloci == 0)
+		return VCF_ENODATA;
+	if ((size = ftell(vcf_file)) < 0)
+		return VCF_EIO;
+	if (fseek(vcf_file, 0, SEEK_SET) != 0)
+		return VCF_EIO;
+
+	per_shard = (nloci + nshards - 1) / nshards;
+	while ((status = next_position(vcf_file, &pos, &offset)) == VCF_OK)
+	{
+		if (n == 0 || (inshard >= per_shard && pos != lastpos && n < nshards))
+		{
+			if (n > 0)
+				shards[n-1].end = pos - 1;
+			shards[n].id = n;
+			shards[n].start = (n == 0) ? 0 : pos;
+			shards[n].end = ULONG_MAX;
+			shards[n].offset = offset;
+			n++;
+			inshard = 0;
+		}
+		inshard++;
+		lastpos = pos;
+	}
+	if (status != VCF_EOF)
+		return status;
+
+	plan = hash_plan(PLAN_BASIS, (unsigned long) size);
+	for (int i = 0; i < n; i++)
+		plan = hash_plan(hash_plan(plan, shards[i].start), (unsigned long) shards[i].offset);
+	for (int i = 0; i < n; i++)
+	{
+		shards[i].nshards = n;
+		shards[i].plan = plan;
+	}
+	*pnplanned = n;
+
+	return VCF_OK;
+}
+// }}}
+
+// Write_plan {{{
+int Write_plan(FILE *plan_file, const SHARD *shards, int nshards)
+{
+	for (int i = 0; i < nshards; i++)
+		if (Write_shard_header(plan_file, &shards[i]) != VCF_OK)
+			return VCF_EIO;
+
+	return VCF_OK;
+}
+// }}}
+
+// Read_shard {{{
+int Read_shard(FILE *plan_file, int id, SHARD *pshard)
+{
+	char line[HEADERLEN];
+	int status;
+
+	while (fgets(line, HEADERLEN, plan_file) != NULL)
+	{
+		if ((status = parse_shard(line, pshard)) != VCF_OK)
+			return status;
+		if (pshard->id == id)
+			return VCF_OK;
+	}
+
+	return VCF_ESHARD;
+}
+// }}}
+
+// Write_shard_header {{{
+int Write_shard_header(FILE *out, const SHARD *pshard)
+{
+	if (fprintf(out, "%s\t%d\t%d\t%lu\t%lu\t%ld\t%lx\n", SHARD_TAG, pshard->id,
+				pshard->nshards, pshard->start, pshard->end, pshard->offset,
+				pshard->plan) < 0)
+		return VCF_EIO;
+
+	return VCF_OK;
+}
+// }}}
+
+// Merge_shards {{{
+
+/* The outputs are sorted by their headers, which must then be the shards
+ * 0, 1, ..., n-1 of one plan, whose ranges follow one another from 0 to
+ * the last position; the bodies are copied as they are. */
+int Merge_shards(FILE **outs, int nouts, FILE *merged)
+{
+	struct {
+		SHARD shard;
+		FILE *out;
+	} *inputs;
+	char line[HEADERLEN], buf[BUFSIZ];
+	size_t nread;
+	int status = VCF_OK;
+
+	if ((inputs = malloc(nouts * sizeof(*inputs))) == NULL)
+		return VCF_ENOMEM;
+
+	for (int i = 0; i < nouts && status == VCF_OK; i++)
+	{
+		inputs[i].out = outs[i];
+		if (fgets(line, HEADERLEN, outs[i]) == NULL)
+			status = VCF_ESHARD;
+		else if (parse_shard(line, &inputs[i].shard) != VCF_OK)
+			status = VCF_ESHARD;
+	}
+	if (status == VCF_OK)
+		qsort(inputs, nouts, sizeof(*inputs), compare_shards);
+
+	for (int i = 0; i < nouts && status == VCF_OK; i++)
+		if (inputs[i].shard.id != i || inputs[i].shard.nshards != nouts
+				|| inputs[i].shard.plan != inputs[0].shard.plan
+				|| (i == 0 && inputs[i].shard.start != 0)
+				|| (i > 0 && (inputs[i-1].shard.end == ULONG_MAX
+						|| inputs[i].shard.start != inputs[i-1].shard.end + 1))
+				|| (i == nouts - 1 && inputs[i].shard.end != ULONG_MAX))
+			status = VCF_ESHARD;
+
+	for (int i = 0; i < nouts && status == VCF_OK; i++)
+	{
+		while ((nread = fread(buf, 1, BUFSIZ, inputs[i].out)) > 0)
+			if (fwrite(buf, 1, nread, merged) != nread)
+			{
+				status = VCF_EIO;
+				break;
+			}
+		if (ferror(inputs[i].out))
+			status = VCF_EIO;
+	}
+
+	free(inputs);
+	return status;
+}
+// }}}
+
+// next_position {{{
+
+/* Reads the position of the next data line, skipping the header; *poffset
+ * is where the line starts. Returns VCF_OK, VCF_EOF or VCF_EMALFORMED. */
+static int next_position(FILE *vcf_file, unsigned long *ppos, long *poffset)
+{
+	int c;
+
+	while ((c = fgetc(vcf_file)) == '#')
+		EATLINE(vcf_file);
+	if (c == EOF)
+		return VCF_EOF;
+	ungetc(c, vcf_file);
+
+	*poffset = ftell(vcf_file);
+	if (fscanf(vcf_file, "%*s%lu", ppos) != 1)
+		return VCF_EMALFORMED;
+	EATLINE(vcf_file);
+
+	return VCF_OK;
+}
+// }}}
+
+// parse_shard {{{
+static int parse_shard(const char *line, SHARD *pshard)
+{
+	if (strncmp(line, SHARD_TAG "\t", strlen(SHARD_TAG) + 1) != 0)
+		return VCF_EMALFORMED;
+	if (sscanf(line + strlen(SHARD_TAG), "%d%d%lu%lu%ld%lx", &pshard->id,
+			&pshard->nshards, &pshard->start, &pshard->end, &pshard->offset,
+			&pshard->plan) != 6)
+		return VCF_EMALFORMED;
+
+	return VCF_OK;
+}
+// }}}
+
+// hash_plan {{{
+
+/* One FNV-1a step over the bytes of value. */
+static unsigned long hash_plan(unsigned long h, unsigned long value)
+{
+	for (size_t b = 0; b < sizeof(value); b++)
+	{
+		h ^= (value >> (8 * b)) & 0xff;
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+// }}}
+
+// compare_shards {{{
+static int compare_shards(const void *p1, const void *p2)
+{
+	const SHARD *pshard1 = (const SHARD *) p1;
+	const SHARD *pshard2 = (const SHARD *) p2;
+
+	return (pshard1->id > pshard2->id) - (pshard1->id < pshard2->id);
+}
+// }}}
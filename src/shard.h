@@ -0,0 +1,65 @@
+/* Interface definition
+ *
+ * Split a genome-wide run across processes and stitch their outputs back.
+ *
+ * A shard is a range of positions of the head loci: each shard computes the
+ * pairs whose first locus falls in its range, reading <winlen> bases past
+ * its end for the partners (the halo). Since the shards cover all the
+ * positions without overlapping, their outputs, concatenated in order, are
+ * the output of a single run.
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+#include <stdio.h>
+
+#define SHARD_TAG "#shard" // first word of the plan and of the outputs
+
+typedef struct shard {
+	int id; // 0, 1, ..., nshards-1
+	int nshards; // number of shards in the plan
+	unsigned long start; // first position of a head locus
+	unsigned long end; // last position of a head locus
+	long offset; // where the first locus of the shard starts in the vcf
+	unsigned long plan; // fingerprint of the plan: the size of the vcf and the cuts
+} SHARD;
+
+/* operation:		cuts a vcf file into shards with about the same
+ * 					number of loci.
+ * precondition:	vcf_file is fopen'd at its beginning; shards has
+ * 					room for nshards shards.
+ * postcondition:	fills the shards, never cutting between loci at the
+ * 					same position, all with the fingerprint of the
+ * 					plan, and sets *pnplanned to their number,
+ * 					which is less than nshards if there are few loci;
+ * 					returns VCF_OK or an error code. */
+int Plan_shards(FILE *vcf_file, int nshards, SHARD *shards, int *pnplanned);
+
+/* operation:		writes the shards of a plan, one per line.
+ * precondition:	plan_file is open for writing.
+ * postcondition:	returns VCF_OK or VCF_EIO. */
+int Write_plan(FILE *plan_file, const SHARD *shards, int nshards);
+
+/* operation:		reads a shard from a plan.
+ * precondition:	plan_file was written by Write_plan().
+ * postcondition:	fills *pshard with shard id; returns VCF_OK,
+ * 					VCF_ESHARD if there is no such shard or
+ * 					VCF_EMALFORMED. */
+int Read_shard(FILE *plan_file, int id, SHARD *pshard);
+
+/* operation:		writes the line that tells which shard an output
+ * 					comes from.
+ * precondition:	out is open for writing; it is the first line.
+ * postcondition:	returns VCF_OK or VCF_EIO. */
+int Write_shard_header(FILE *out, const SHARD *pshard);
+
+/* operation:		stitches the outputs of the shards into one.
+ * precondition:	outs are the outputs of all the shards of a plan, in
+ * 					any order, each starting with its shard header.
+ * postcondition:	writes to merged the outputs in shard order, without
+ * 					their headers; returns VCF_OK, VCF_EIO or VCF_ESHARD
+ * 					if the shards are missing, repeated, from different
+ * 					plans, or do not cover all the positions. */
+int Merge_shards(FILE **outs, int nouts, FILE *merged);
+
+#endif
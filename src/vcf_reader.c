@@ -0,0 +1,244 @@
+/* Interface implementation */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vcf_reader.h"
+
+static void *parse_chunks(void *arg);
+static int read_chunk(VCF_READER *preader, VCF_CHUNK *pchunk);
+static void parse_chunk(VCF_READER *preader, VCF_CHUNK *pchunk);
+
+
+// Open_reader {{{
+int Open_reader(VCF_READER *preader, FILE *vcf_file, int nthreads,
+				VCF_PARSE parse, VCF_DISCARD discard, const void *parse_data)
+{
+	memset(preader, 0, sizeof(VCF_READER));
+	preader->vcf_file = vcf_file;
+	preader->parse = parse;
+	preader->discard = discard;
+	preader->parse_data = parse_data;
+	preader->nchunks = READER_SLOTS * nthreads;
+	preader->chunks = (VCF_CHUNK *) calloc(preader->nchunks, sizeof(VCF_CHUNK));
+	preader->threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+	if (preader->chunks == NULL || preader->threads == NULL)
+	{
+		free(preader->chunks);
+		free(preader->threads);
+		return VCF_ENOMEM;
+	}
+	pthread_mutex_init(&preader->lock, NULL);
+	pthread_cond_init(&preader->parsed, NULL);
+	pthread_cond_init(&preader->consumed, NULL);
+
+	for (int t = 0; t < nthreads; t++)
+	{
+		if (pthread_create(&preader->threads[t], NULL, parse_chunks, preader) != 0)
+		{
+			Close_reader(preader);
+			return VCF_EIO;
+		}
+		preader->nthreads++;
+	}
+
+	return VCF_OK;
+}
+// }}}
+
+// Read_locus {{{
+int Read_locus(VCF_READER *preader, VCF_LOCUS *plocus)
+{
+	VCF_CHUNK *pchunk;
+
+	while (true)
+	{
+		pchunk = &preader->chunks[preader->ncurrent % preader->nchunks];
+
+		pthread_mutex_lock(&preader->lock);
+		while (!pchunk->ready)
+			pthread_cond_wait(&preader->parsed, &preader->lock);
+		pthread_mutex_unlock(&preader->lock);
+
+		// No thread touches a ready chunk, it is ours until we free it.
+		if (pchunk->next < pchunk->nloci)
+		{
+			*plocus = pchunk->loci[pchunk->next++];
+			return VCF_OK;
+		}
+		if (pchunk->status != VCF_OK)
+			return pchunk->status;
+
+		pthread_mutex_lock(&preader->lock);
+		pchunk->ready = false;
+		preader->ncurrent++;
+		pthread_cond_broadcast(&preader->consumed);
+		pthread_mutex_unlock(&preader->lock);
+	}
+}
+// }}}
+
+// Close_reader {{{
+void Close_reader(VCF_READER *preader)
+{
+	VCF_CHUNK *pchunk;
+
+	pthread_mutex_lock(&preader->lock);
+	preader->stop = true;
+	pthread_cond_broadcast(&preader->consumed);
+	pthread_mutex_unlock(&preader->lock);
+	for (int t = 0; t < preader->nthreads; t++)
+		pthread_join(preader->threads[t], NULL);
+
+	for (int k = 0; k < preader->nchunks; k++)
+	{
+		pchunk = &preader->chunks[k];
+		if (pchunk->ready)
+			for (size_t i = pchunk->next; i < pchunk->nloci; i++)
+				(*preader->discard)(&pchunk->loci[i]);
+		free(pchunk->text);
+		free(pchunk->loci);
+	}
+	free(preader->chunks);
+	free(preader->threads);
+	free(preader->carry);
+	pthread_mutex_destroy(&preader->lock);
+	pthread_cond_destroy(&preader->parsed);
+	pthread_cond_destroy(&preader->consumed);
+	preader->chunks = NULL;
+	preader->threads = NULL;
+	preader->carry = NULL;
+}
+// }}}
+
+// parse_chunks {{{
+
+/* The body of each thread: takes the next chunk of the file whenever its
+ * slot is free, parses it and marks it ready. */
+static void *parse_chunks(void *arg)
+{
+	VCF_READER *preader = (VCF_READER *) arg;
+	VCF_CHUNK *pchunk;
+
+	pthread_mutex_lock(&preader->lock);
+	while (!preader->stop)
+	{
+		if (preader->eof || preader->nread >= preader->ncurrent + preader->nchunks)
+		{
+			pthread_cond_wait(&preader->consumed, &preader->lock);
+			continue;
+		}
+
+		// Reading under the lock keeps the chunks in file order.
+		pchunk = &preader->chunks[preader->nread++ % preader->nchunks];
+		pchunk->nloci = pchunk->next = 0;
+		pchunk->status = read_chunk(preader, pchunk);
+		pthread_mutex_unlock(&preader->lock);
+
+		if (pchunk->status == VCF_OK || pchunk->status == VCF_EOF)
+			parse_chunk(preader, pchunk);
+
+		pthread_mutex_lock(&preader->lock);
+		pchunk->ready = true;
+		pthread_cond_broadcast(&preader->parsed);
+	}
+	pthread_mutex_unlock(&preader->lock);
+
+	return NULL;
+}
+// }}}
+
+// read_chunk {{{
+
+/* Reads the lines following the last chunk, about READER_CHUNK bytes; the
+ * start of a line past them is carried over to the next chunk. Returns
+ * VCF_EOF for the last chunk of the file, which is still to be parsed. */
+static int read_chunk(VCF_READER *preader, VCF_CHUNK *pchunk)
+{
+	size_t len, nbytes, end;
+	char *tmp;
+
+	if (pchunk->maxtext < preader->ncarry + READER_CHUNK + 1)
+	{
+		tmp = (char *) realloc(pchunk->text, preader->ncarry + READER_CHUNK + 1);
+		if (tmp == NULL)
+			return VCF_ENOMEM;
+		pchunk->text = tmp;
+		pchunk->maxtext = preader->ncarry + READER_CHUNK + 1;
+	}
+
+	if (preader->ncarry > 0)
+		memcpy(pchunk->text, preader->carry, preader->ncarry);
+	nbytes = fread(pchunk->text + preader->ncarry, 1, READER_CHUNK, preader->vcf_file);
+	len = preader->ncarry + nbytes;
+	preader->ncarry = 0;
+	if (nbytes < READER_CHUNK)
+	{
+		preader->eof = true;
+		if (ferror(preader->vcf_file))
+			return VCF_EIO;
+		pchunk->text[len] = '\0';
+		return VCF_EOF;
+	}
+
+	// Carry over what follows the last newline
+	for (end = len; end > 0 && pchunk->text[end-1] != '\n'; end--)
+		;
+	if (len - end > preader->maxcarry)
+	{
+		if ((tmp = (char *) realloc(preader->carry, len - end)) == NULL)
+			return VCF_ENOMEM;
+		preader->carry = tmp;
+		preader->maxcarry = len - end;
+	}
+	preader->ncarry = len - end;
+	memcpy(preader->carry, pchunk->text + end, preader->ncarry);
+	pchunk->text[end] = '\0';
+
+	return VCF_OK;
+}
+// }}}
+
+// parse_chunk {{{
+
+/* Parses the lines of a chunk into its loci, leaving out the filtered
+ * ones, up to the first which fails, whose status replaces that of the
+ * chunk. */
+static void parse_chunk(VCF_READER *preader, VCF_CHUNK *pchunk)
+{
+	char *line = pchunk->text, *newline;
+	VCF_LOCUS *tmp;
+	size_t maxloci;
+	int status;
+
+	while (*line != '\0')
+	{
+		if ((newline = strchr(line, '\n')) != NULL)
+			*newline = '\0';
+
+		if (pchunk->nloci == pchunk->maxloci)
+		{
+			maxloci = (pchunk->maxloci == 0) ? 256 : 2 * pchunk->maxloci;
+			if ((tmp = (VCF_LOCUS *) realloc(pchunk->loci, maxloci * sizeof(VCF_LOCUS))) == NULL)
+			{
+				pchunk->status = VCF_ENOMEM;
+				return;
+			}
+			pchunk->loci = tmp;
+			pchunk->maxloci = maxloci;
+		}
+		status = (*preader->parse)(&pchunk->loci[pchunk->nloci], line, preader->parse_data);
+		if (status == VCF_OK)
+			pchunk->nloci++;
+		else if (status != VCF_FILTERED)
+		{
+			pchunk->status = status;
+			return;
+		}
+
+		if (newline == NULL)
+			break;
+		line = newline + 1;
+	}
+}
+// }}}
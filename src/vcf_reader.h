@@ -0,0 +1,84 @@
+/* Interface definition
+ *
+ * Parse a VCF with several threads, handing the loci back in file order.
+ *
+ * The file is read in chunks of whole lines, one thread at a time, so
+ * that the chunks come in file order; each thread then parses the lines
+ * of its chunk into loci on its own. The loci of a chunk are handed out
+ * once it is parsed and all the chunks before it have been handed out.
+ * A ring of a few chunks per thread bounds the loci parsed ahead.
+ */
+
+#ifndef _VCF_READER_H_
+#define _VCF_READER_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "ld_vcf.h"
+
+#define READER_CHUNK (4 << 20) // bytes of text in a chunk, before the line ends
+#define READER_SLOTS 2 // chunks per thread
+
+/* Parses a line (without its newline) into a locus, as digest_line() does;
+ * frees what it allocated if it fails, and returns VCF_FILTERED for the
+ * loci to leave out. parse_data is shared by the threads, read-only. */
+typedef int (*VCF_PARSE)(VCF_LOCUS *plocus, char *line, const void *parse_data);
+/* Frees what a locus holds, for the loci read ahead and never handed out. */
+typedef void (*VCF_DISCARD)(VCF_LOCUS *plocus);
+
+typedef struct vcf_chunk {
+	char *text; // the lines of the chunk
+	size_t maxtext; // allocated length of text
+	VCF_LOCUS *loci; // parsed from text, in order
+	size_t nloci, maxloci;
+	size_t next; // next locus to hand out
+	int status; // after the loci: VCF_OK, VCF_EOF or an error code
+	bool ready; // parsed, waiting to be handed out
+} VCF_CHUNK;
+
+typedef struct vcf_reader {
+	FILE *vcf_file;
+	VCF_PARSE parse;
+	VCF_DISCARD discard;
+	const void *parse_data;
+	pthread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock; // guards the file and the state of the ring
+	pthread_cond_t parsed; // a chunk is ready
+	pthread_cond_t consumed; // a slot is free
+	VCF_CHUNK *chunks; // chunk k goes in slot k % nchunks
+	int nchunks;
+	unsigned long nread; // chunks read from the file
+	unsigned long ncurrent; // chunk being handed out
+	char *carry; // start of a line, past the end of the last chunk
+	size_t ncarry, maxcarry;
+	bool eof; // the file has been read
+	bool stop; // the threads are to exit
+} VCF_READER;
+
+/* operation:		starts nthreads threads parsing the file from its
+ * 					current position.
+ * precondition:	vcf_file is positioned at the start of a line and not
+ * 					read by anyone else until Close_reader().
+ * postcondition:	returns VCF_OK, VCF_ENOMEM or VCF_EIO if the threads
+ * 					could not start. */
+int Open_reader(VCF_READER *preader, FILE *vcf_file, int nthreads,
+				VCF_PARSE parse, VCF_DISCARD discard, const void *parse_data);
+
+/* operation:		hands out the next locus of the file that is not left
+ * 					out.
+ * precondition:	preader is open.
+ * postcondition:	returns VCF_OK and the locus, which the caller now owns,
+ * 					or VCF_EOF at the end of the file, or the error of the
+ * 					line which failed; errors and VCF_EOF are returned
+ * 					again on further calls. */
+int Read_locus(VCF_READER *preader, VCF_LOCUS *plocus);
+
+/* operation:		stops the threads.
+ * precondition:	preader is open.
+ * postcondition:	the loci read ahead are discarded and the memory freed;
+ * 					the position of the file is past them. */
+void Close_reader(VCF_READER *preader);
+
+#endif